@@ -1,9 +1,25 @@
 #include <stdint.h>
-#include <fstream>
-#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#endif
 
 #include "opencv2/core/core.hpp"
 #include "mjpegreader.hpp"
+#include "mjpegwriter.hpp"
 
 namespace cv
 {
@@ -22,241 +38,628 @@ namespace mjpeg
 #define MJPG_CC           fourCC_str("MJPG")
 #define STRF_CC           fourCC_str("strf")
 #define AVI_CC            fourCC_str("AVI ")
-
-typedef uint32_t DWORD;
-typedef uint16_t WORD;
-typedef int32_t  LONG;
-
+#define AVIX_CC           fourCC_str("AVIX")
+#define MOVI_CC           fourCC_str("movi")
+#define REC_CC            fourCC_str("rec ")
+#define IDX1_CC           fourCC_str("idx1")
 
 #pragma pack(push, 1)
-struct AviMainHeader
-{
-    DWORD dwMicroSecPerFrame;    //  The period between video frames
-    DWORD dwMaxBytesPerSec;      //  Maximum data rate of the file
-    DWORD dwReserved1;           // 0
-    DWORD dwFlags;               //  0x10 AVIF_HASINDEX: The AVI file has an idx1 chunk containing an index at the end of the file.
-    DWORD dwTotalFrames;         // Field of the main header specifies the total number of frames of data in file.
-    DWORD dwInitialFrames;       // Is used for interleaved files
-    DWORD dwStreams;             // Specifies the number of streams in the file.
-    DWORD dwSuggestedBufferSize; // Field specifies the suggested buffer size forreading the file
-    DWORD dwWidth;               // Fields specify the width of the AVIfile in pixels.
-    DWORD dwHeight;              // Fields specify the height of the AVIfile in pixels.
-    DWORD dwReserved[4];         // 0, 0, 0, 0
-};
-
-struct AviStreamHeader
-{
-    uint32_t fccType;              // 'vids', 'auds', 'txts'...
-    uint32_t fccHandler;           // "cvid", "DIB "
-    DWORD dwFlags;               // 0
-    DWORD dwPriority;            // 0
-    DWORD dwInitialFrames;       // 0
-    DWORD dwScale;               // 1
-    DWORD dwRate;                // Fps (dwRate - frame rate for video streams)
-    DWORD dwStart;               // 0
-    DWORD dwLength;              // Frames number (playing time of AVI file as defined by scale and rate)
-    DWORD dwSuggestedBufferSize; // For reading the stream
-    DWORD dwQuality;             // -1 (encoding quality. If set to -1, drivers use the default quality value)
-    DWORD dwSampleSize;          // 0 means that each frame is in its own chunk
-    struct {
-        short int left;
-        short int top;
-        short int right;
-        short int bottom;
-    } rcFrame;                // If stream has a different size than dwWidth*dwHeight(unused)
-};
-
-struct BitmapInfoHeader
-{
-    DWORD biSize;                // Write header size of BITMAPINFO header structure
-    LONG  biWidth;               // width in pixels
-    LONG  biHeight;              // heigth in pixels
-    WORD  biPlanes;              // Number of color planes in which the data is stored
-    WORD  biBitCount;            // Number of bits per pixel
-    DWORD biCompression;         // Type of compression used (uncompressed: NO_COMPRESSION=0)
-    DWORD biSizeImage;           // Image Buffer. Quicktime needs 3 bytes also for 8-bit png 
-                                 //   (biCompression==NO_COMPRESSION)?0:xDim*yDim*bytesPerPixel;
-    LONG  biXPelsPerMeter;       // Horizontal resolution in pixels per meter
-    LONG  biYPelsPerMeter;       // Vertical resolution in pixels per meter
-    DWORD biClrUsed;             // 256 (color table size; for 8-bit only)
-    DWORD biClrImportant;        // Specifies that the first x colors of the color table. Are important to the DIB.
-};
-
 struct RiffChunk
 {
     uint32_t m_four_cc;
     uint32_t m_size;
 };
 
-struct RiffList
+struct AviIndexEntry
 {
-    uint32_t m_riff_or_list_cc;
-    uint32_t m_size;
-    uint32_t m_list_type_cc;
+    uint32_t ckid;
+    DWORD    dwFlags;
+    DWORD    dwChunkOffset;
+    DWORD    dwChunkLength;
 };
-
 #pragma pack(pop)
 
-void printFourCc(const uint32_t& four_cc)
+// read-only mapping of the whole file
+class MappedFile
 {
-    char result[5];
-    uint32_t* p_4cc = (uint32_t*)result;
+public:
+    MappedFile() : m_data(0), m_size(0)
+    {
+#ifdef _WIN32
+        m_file = m_mapping = 0;
+#else
+        m_fd = -1;
+#endif
+    }
+    ~MappedFile() { close(); }
 
-    *p_4cc = four_cc;
+    bool open(const std::string& filename)
+    {
+        close();
+#ifdef _WIN32
+        m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                             0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+        if( m_file == INVALID_HANDLE_VALUE )
+        {
+            m_file = 0;
+            return false;
+        }
+#else
+        m_fd = ::open(filename.c_str(), O_RDONLY);
+        if( m_fd < 0 )
+            return false;
+#endif
+        if( !remap() )
+            close();
+        return m_data != 0;
+    }
 
-    result[4] = 0;
+    // maps the file again if it has grown since it was mapped.
+    // Pointers to the old mapping become invalid
+    bool remap()
+    {
+        size_t size = 0;
+#ifdef _WIN32
+        LARGE_INTEGER fsize;
+        if( GetFileSizeEx(m_file, &fsize) )
+            size = (size_t)fsize.QuadPart;
+#else
+        struct stat st;
+        if( fstat(m_fd, &st) == 0 )
+            size = (size_t)st.st_size;
+#endif
+        if( size <= m_size )
+            return false;
+
+        unmap();
+#ifdef _WIN32
+        m_mapping = CreateFileMappingA(m_file, 0, PAGE_READONLY, 0, 0, 0);
+        if( m_mapping )
+            m_data = (const uchar*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, size);
+#else
+        void* p = mmap(0, size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if( p != MAP_FAILED )
+            m_data = (const uchar*)p;
+#endif
+        m_size = m_data ? size : 0;
+        return m_data != 0;
+    }
 
-    std::cout << result << std::endl;
-}
+    void close()
+    {
+        unmap();
+#ifdef _WIN32
+        if( m_file )
+            CloseHandle(m_file);
+        m_file = 0;
+#else
+        if( m_fd >= 0 )
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+    }
 
-std::istream& operator >> (std::istream& is, AviMainHeader& avih) 
-{
-    is.read((char*)(&avih), sizeof(AviMainHeader));
-}
+    const uchar* data() const { return m_data; }
+    size_t size() const { return m_size; }
 
-std::istream& operator >> (std::istream& is, AviStreamHeader& strh) 
-{
-    is.read((char*)(&strh), sizeof(AviStreamHeader));
-}
+protected:
+    void unmap()
+    {
+#ifdef _WIN32
+        if( m_data )
+            UnmapViewOfFile(m_data);
+        if( m_mapping )
+            CloseHandle(m_mapping);
+        m_mapping = 0;
+#else
+        if( m_data )
+            munmap((void*)m_data, m_size);
+#endif
+        m_data = 0;
+        m_size = 0;
+    }
 
-std::istream& operator >> (std::istream& is, BitmapInfoHeader& bmph) 
-{
-    is.read((char*)(&bmph), sizeof(BitmapInfoHeader));
-}
+    const uchar* m_data;
+    size_t  m_size;
+#ifdef _WIN32
+    HANDLE  m_file, m_mapping;
+#else
+    int     m_fd;
+#endif
+};
 
-std::istream& operator >> (std::istream& is, RiffList& riff_list) 
+// a chunk of a RIFF file. For RIFF and LIST chunks list_type is set
+// and the data follows it, so size excludes the list type
+struct RiffChunkRef
 {
-    is.read((char*)(&riff_list), sizeof(riff_list));
-}
+    uint32_t four_cc;
+    uint32_t list_type;
+    const uchar* data;
+    size_t size;
+    bool truncated; // the chunk goes past the end of its parent or of the file
+};
 
-std::istream& operator >> (std::istream& is, RiffChunk& riff_chunk) 
+// iterates over the sequence of chunks in [begin, end).
+// The chunks are word-aligned (odd-sized ones are followed by a padding byte)
+// and are clipped to the end of the sequence if the file is truncated.
+// If unsized_lists is set, RIFF and LIST chunks of size 0 (not patched yet by the writer
+// of the file) extend to the end of the sequence
+class RiffWalker
 {
-    is.read((char*)(&riff_chunk), sizeof(riff_chunk));
-}
+public:
+    RiffWalker(const uchar* begin, const uchar* end, bool unsized_lists=false)
+        : m_current(begin), m_end(end), m_unsized_lists(unsized_lists) {}
+
+    bool next(RiffChunkRef& chunk)
+    {
+        if( m_end - m_current < (ptrdiff_t)sizeof(RiffChunk) )
+            return false;
+
+        RiffChunk hdr;
+        memcpy(&hdr, m_current, sizeof(hdr));
+        const uchar* data = m_current + sizeof(hdr);
+        size_t size = std::min((size_t)hdr.m_size, (size_t)(m_end - data));
+
+        chunk.four_cc = hdr.m_four_cc;
+        chunk.list_type = 0;
+        chunk.truncated = size < hdr.m_size;
+        if( hdr.m_four_cc == RIFF_CC || hdr.m_four_cc == LIST_CC )
+        {
+            if( hdr.m_size == 0 && m_unsized_lists )
+                size = (size_t)(m_end - data);
+            if( size < sizeof(uint32_t) )
+                return false;
+            memcpy(&chunk.list_type, data, sizeof(uint32_t));
+            chunk.data = data + sizeof(uint32_t);
+            chunk.size = size - sizeof(uint32_t);
+        }
+        else
+        {
+            chunk.data = data;
+            chunk.size = size;
+        }
+
+        size += size & 1;
+        m_current = data + std::min(size, (size_t)(m_end - data));
+        return true;
+    }
+
+protected:
+    const uchar* m_current;
+    const uchar* m_end;
+    bool m_unsized_lists;
+};
 
 class MJpegReaderImpl : public MJpegReader
 {
 public:
-    MJpegReaderImpl(const std::string& filename, Size size, double fps, int colorspace)
+    MJpegReaderImpl(const std::string& filename, Size size, double fps, int colorspace, bool follow)
     {
-        std::fstream fs;
-        fs.open (filename.c_str(), std::fstream::in | std::fstream::binary);
-
-        RiffList riff_list;
+        CV_Assert( colorspace == COLORSPACE_GRAY || colorspace == COLORSPACE_RGBA ||
+                   colorspace == COLORSPACE_BGR || colorspace == COLORSPACE_YUV444P );
+        m_colorspace = colorspace;
+        m_fps = 0;
+        m_is_opened = false;
+        m_frame_idx = 0;
+        m_follow = follow;
+        m_finished = !follow;
+        m_follow_pos = 0;
+#ifdef __linux__
+        m_notify_fd = -1;
+#endif
+        m_decoder = jpeg::createJpegDecoder();
+
+        if( !m_file.open(filename) || !parseRiff() )
+        {
+            close();
+            return;
+        }
 
-        fs >> riff_list;
+        if( m_strh.dwRate > 0 && m_strh.dwScale > 0 )
+            m_fps = (double)m_strh.dwRate/m_strh.dwScale;
+        else if( m_avih.dwMicroSecPerFrame > 0 )
+            m_fps = 1e6/m_avih.dwMicroSecPerFrame;
+        else
+            m_fps = fps;
 
-        std::cout << (RIFF_CC == fourCC_str("RIFF")) << std::endl;;
+        if( size.area() > 0 && (size.width != m_bmih.biWidth || size.height != std::abs(m_bmih.biHeight)) )
+        {
+            close();
+            return;
+        }
 
-        if(riff_list.m_riff_or_list_cc == RIFF_CC)
+#ifdef __linux__
+        // the changes of the file are waited for with inotify, if it is available
+        if( m_follow )
         {
-            if(riff_list.m_list_type_cc == AVI_CC)
+            m_notify_fd = inotify_init1(IN_NONBLOCK);
+            if( m_notify_fd >= 0 && inotify_add_watch(m_notify_fd, filename.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0 )
             {
-                std::cout << "AVI" << std::endl;
-                RiffList list;
-
-                fs >> list;
-
-                if(list.m_riff_or_list_cc == LIST_CC)
-                {
-                    std::cout << "LIST" << std::endl;
-                    std::cout << list.m_size << std::endl;
-
-                    printFourCc(list.m_list_type_cc);
-
-                    RiffChunk hdrl;
+                ::close(m_notify_fd);
+                m_notify_fd = -1;
+            }
+        }
+#endif
+        m_is_opened = true;
+    }
 
-                    fs >> hdrl;
+    ~MJpegReaderImpl()
+    {
+        close();
+    }
 
-                    printFourCc(hdrl.m_four_cc);
+    void close()
+    {
+        m_file.close();
+        m_frames.clear();
+#ifdef __linux__
+        if( m_notify_fd >= 0 )
+            ::close(m_notify_fd);
+        m_notify_fd = -1;
+#endif
+        m_is_opened = false;
+    }
 
-                    AviMainHeader avi_head;
-                    fs >> avi_head;
+    bool grab(const uchar*& data, size_t& size, int timeout_ms)
+    {
+        if( !m_is_opened )
+            return false;
 
-                    fs >> list;
+        if( m_frame_idx >= m_frames.size() && !m_finished )
+        {
+            int64 start = getTickCount();
+            for(;;)
+            {
+                if( m_file.remap() )
+                    followMovi();
+                if( m_frame_idx < m_frames.size() || m_finished )
+                    break;
+                int elapsed = (int)((getTickCount() - start)*1000/getTickFrequency());
+                if( elapsed >= timeout_ms )
+                    break;
+                waitForChanges(timeout_ms - elapsed);
+            }
+        }
 
-                    if(list.m_riff_or_list_cc == LIST_CC)
-                    {
-                        printFourCc(list.m_list_type_cc);
-                    }
+        if( m_frame_idx >= m_frames.size() )
+            return false;
+        const FrameRef& frame = m_frames[m_frame_idx++];
+        data = m_file.data() + frame.offset;
+        size = frame.size;
+        return true;
+    }
 
-                    fs >> hdrl;
-                    printFourCc(hdrl.m_four_cc);
+    // decodes the next frame into img, which must be allocated for the frame size and the colorspace
+    bool read(const Mat& img)
+    {
+        int width = m_bmih.biWidth, height = std::abs(m_bmih.biHeight);
+        int type = m_colorspace == COLORSPACE_RGBA ? CV_8UC4 : m_colorspace == COLORSPACE_BGR ? CV_8UC3 : CV_8UC1;
+        int rows = m_colorspace == COLORSPACE_YUV444P ? height*3 : height;
+        const uchar* data;
+        size_t size;
+
+        CV_Assert( img.cols == width && img.rows == rows && img.type() == type );
+        if( !grab(data, size, 0) )
+            return false;
+
+        // the frame is decoded in place, unless its size does not match the headers
+        Mat dst = img;
+        int colorspace = m_colorspace == COLORSPACE_GRAY ? jpeg::COLORSPACE_GRAY :
+                         m_colorspace == COLORSPACE_RGBA ? jpeg::COLORSPACE_BGRA :
+                         m_colorspace == COLORSPACE_BGR ? jpeg::COLORSPACE_BGR : jpeg::COLORSPACE_YUV444P;
+        if( !m_decoder->decode(data, size, dst, colorspace) || dst.data != img.data )
+            return false;
+
+        if( m_colorspace == COLORSPACE_RGBA )
+            for( int y = 0; y < height; y++ )
+            {
+                uchar* row = dst.ptr(y);
+                for( int x = 0; x < width; x++ )
+                    std::swap(row[x*4], row[x*4 + 2]);
+            }
+        return true;
+    }
 
-                    AviStreamHeader strh;
-                    fs >> strh;
+    bool isOpened() const
+    {
+        return m_is_opened;
+    }
 
-                    printFourCc(strh.fccType);
-                    printFourCc(strh.fccHandler);
+    const AviMainHeader& getMainHeader() const { return m_avih; }
+    const AviStreamHeader& getStreamHeader() const { return m_strh; }
+    const BitmapInfoHeader& getBitmapInfoHeader() const { return m_bmih; }
+    int getFrameCount() const { return (int)m_frames.size(); }
+    double getFps() const { return m_fps; }
 
-                    fs >> hdrl;
-                    printFourCc(hdrl.m_four_cc);
+protected:
+    // JPEG data of a frame
+    struct FrameRef
+    {
+        size_t offset;
+        size_t size;
+    };
 
-                    BitmapInfoHeader bmp_info_header;
-                    fs >> bmp_info_header;
+    bool parseRiff()
+    {
+        const uchar* data = m_file.data();
+        RiffWalker walker(data, data + m_file.size(), m_follow);
+        RiffChunkRef chunk;
+        bool found_avi = false;
+
+        memset(&m_avih, 0, sizeof(m_avih));
+        memset(&m_strh, 0, sizeof(m_strh));
+        memset(&m_bmih, 0, sizeof(m_bmih));
+        m_video_cc = 0;
+
+        // 'AVI ' is followed by 'AVIX' extensions in OpenDML files
+        while( walker.next(chunk) )
+        {
+            if( chunk.four_cc != RIFF_CC )
+                return false;
+            if( chunk.list_type == AVI_CC && !found_avi )
+            {
+                // the size of the file being recorded is not patched yet
+                if( m_follow )
+                    chunk.size = (size_t)(data + m_file.size() - chunk.data);
+                if( !parseAvi(chunk) )
+                    return false;
+                found_avi = true;
+                if( m_follow )
+                    break;
+            }
+            else if( chunk.list_type == AVIX_CC && found_avi )
+                parseMovi(chunk);
+        }
+        return found_avi;
+    }
 
-                    std::cout << bmp_info_header.biBitCount << std::endl;
+    bool parseAvi(const RiffChunkRef& avi)
+    {
+        RiffWalker walker(avi.data, avi.data + avi.size, m_follow);
+        RiffChunkRef chunk, movi;
+        bool found_movi = false, found_index = false;
 
-                    printFourCc(bmp_info_header.biCompression);
+        while( walker.next(chunk) )
+        {
+            if( chunk.four_cc == LIST_CC && chunk.list_type == HDRL_CC )
+            {
+                if( !parseHeaderList(chunk) )
+                    return false;
+            }
+            else if( chunk.four_cc == LIST_CC && chunk.list_type == MOVI_CC && !found_movi )
+            {
+                movi = chunk;
+                found_movi = true;
+                if( m_follow )
+                    break;
+            }
+            else if( chunk.four_cc == IDX1_CC && found_movi && m_video_cc != 0 )
+                found_index = parseIndex(chunk, movi);
+            // JUNK and unknown chunks are skipped
+        }
 
-                    fs >> list;
+        if( m_video_cc == 0 || !found_movi )
+            return false;
+        if( m_follow )
+        {
+            m_follow_pos = (size_t)(movi.data - m_file.data());
+            followMovi();
+        }
+        else if( !found_index )
+            parseMovi(movi);
+        return true;
+    }
 
-                    if(list.m_riff_or_list_cc == LIST_CC)
-                    {
-                        std::cout << "LIST" << std::endl;
-                        std::cout << list.m_size << std::endl;
+    bool parseHeaderList(const RiffChunkRef& hdrl)
+    {
+        RiffWalker walker(hdrl.data, hdrl.data + hdrl.size);
+        RiffChunkRef chunk;
+        int stream_idx = 0;
+        bool found_avih = false;
 
-                        printFourCc(list.m_list_type_cc);
+        while( walker.next(chunk) )
+        {
+            if( chunk.four_cc == AVIH_CC && chunk.size >= sizeof(m_avih) )
+            {
+                memcpy(&m_avih, chunk.data, sizeof(m_avih));
+                found_avih = true;
+            }
+            else if( chunk.four_cc == LIST_CC && chunk.list_type == STRL_CC )
+                parseStreamList(chunk, stream_idx++);
+        }
+        return found_avih;
+    }
 
-                        fs >> hdrl;
-                        printFourCc(hdrl.m_four_cc);
+    void parseStreamList(const RiffChunkRef& strl, int stream_idx)
+    {
+        RiffWalker walker(strl.data, strl.data + strl.size);
+        RiffChunkRef chunk;
+        AviStreamHeader strh;
+        BitmapInfoHeader bmih;
+        bool found_strh = false, found_strf = false;
+
+        // the header of a stream precedes its format, but the order is not relied upon
+        while( walker.next(chunk) )
+        {
+            if( chunk.four_cc == STRH_CC && chunk.size >= sizeof(strh) - sizeof(strh.rcFrame) )
+            {
+                memset(&strh, 0, sizeof(strh));
+                memcpy(&strh, chunk.data, std::min(chunk.size, sizeof(strh)));
+                found_strh = true;
+            }
+            else if( chunk.four_cc == STRF_CC && chunk.size >= sizeof(bmih) )
+            {
+                memcpy(&bmih, chunk.data, sizeof(bmih));
+                found_strf = true;
+            }
+        }
 
-                        std::cout << hdrl.m_size << std::endl;
+        // the first MJPEG video stream is read, the rest are ignored
+        if( m_video_cc == 0 && found_strh && found_strf && strh.fccType == VIDS_CC &&
+            (bmih.biCompression == MJPG_CC || strh.fccHandler == MJPG_CC) &&
+            stream_idx < 100 )
+        {
+            m_strh = strh;
+            m_bmih = bmih;
+            // frames of the stream are stored in '##dc' chunks
+            m_video_cc = fourCC('0' + stream_idx/10, '0' + stream_idx%10, 'd', 'c');
+        }
+    }
 
-                        fs.seekg(hdrl.m_size, fs.cur);
+    // the offsets of idx1 are relative to the 'movi' list type, but some files have absolute ones
+    bool parseIndex(const RiffChunkRef& idx1, const RiffChunkRef& movi)
+    {
+        const uchar* data = m_file.data();
+        size_t file_size = m_file.size();
+        size_t i, n = idx1.size/sizeof(AviIndexEntry);
+        size_t base = (size_t)(movi.data - data) - sizeof(uint32_t);
+        bool base_checked = false;
+        std::vector<FrameRef> frames;
+
+        for( i = 0; i < n; i++ )
+        {
+            AviIndexEntry entry;
+            memcpy(&entry, idx1.data + i*sizeof(entry), sizeof(entry));
+            if( entry.ckid != (uint32_t)m_video_cc )
+                continue;
 
-                        fs >> hdrl;
-                        printFourCc(hdrl.m_four_cc);
+            if( !base_checked )
+            {
+                uint32_t cc = 0;
+                size_t pos = base + entry.dwChunkOffset;
+                if( pos + sizeof(RiffChunk) <= file_size )
+                    memcpy(&cc, data + pos, sizeof(cc));
+                if( cc != entry.ckid )
+                    base = 0;
+                base_checked = true;
+            }
 
-                        fs.seekg(hdrl.m_size, fs.cur);
+            size_t offset = base + entry.dwChunkOffset + sizeof(RiffChunk);
+            if( offset > file_size || entry.dwChunkLength > file_size - offset )
+                return false;
+            addFrame(frames, offset, entry.dwChunkLength);
+        }
 
-                        fs >> list;
-                        if(list.m_riff_or_list_cc == LIST_CC)
-                        {
-                            std::cout << "LIST" << std::endl;
-                            std::cout << list.m_size << std::endl;
+        if( frames.empty() )
+            return false;
+        m_frames.insert(m_frames.end(), frames.begin(), frames.end());
+        return true;
+    }
 
-                            printFourCc(list.m_list_type_cc);
-                        }
-                    }
-                }
-            }
+    // an empty frame chunk (written by MJpegWriter for a duplicate frame) repeats the previous frame
+    static void addFrame(std::vector<FrameRef>& frames, size_t offset, size_t size)
+    {
+        FrameRef frame;
+        frame.offset = offset;
+        frame.size = size;
+        if( size == 0 )
+        {
+            if( frames.empty() )
+                return;
+            frame = frames.back();
         }
+        frames.push_back(frame);
     }
 
-    ~MJpegReaderImpl()
+    // collects the frames of a 'movi' list when there is no index
+    void parseMovi(const RiffChunkRef& movi)
     {
+        RiffWalker walker(movi.data, movi.data + movi.size);
+        RiffChunkRef chunk;
 
+        while( walker.next(chunk) )
+        {
+            if( chunk.four_cc == (uint32_t)m_video_cc && !chunk.truncated )
+                addFrame(m_frames, (size_t)(chunk.data - m_file.data()), chunk.size);
+            else if( chunk.four_cc == LIST_CC && (chunk.list_type == REC_CC || chunk.list_type == MOVI_CC) )
+                parseMovi(chunk);
+        }
     }
 
-    bool read(const Mat& img)
+    // adds the frames appended to 'movi' since the last call. The sizes of the
+    // chunks are patched by the writer when they are complete, and idx1 is
+    // written after 'movi' when the recording is finished
+    void followMovi()
     {
+        const uchar* data = m_file.data();
+        size_t file_size = m_file.size();
 
+        while( m_follow_pos + sizeof(RiffChunk) <= file_size )
+        {
+            RiffChunk hdr;
+            memcpy(&hdr, data + m_follow_pos, sizeof(hdr));
+            size_t end = m_follow_pos + sizeof(hdr) + hdr.m_size;
+
+            if( hdr.m_four_cc == IDX1_CC || hdr.m_four_cc == RIFF_CC )
+            {
+                m_finished = true;
+                break;
+            }
+            if( hdr.m_four_cc == 0 || end > file_size )
+                break;
+            // a frame chunk of size 0 is either being written (its JPEG data follows)
+            // or empty (the next chunk follows)
+            if( hdr.m_size == 0 && hdr.m_four_cc == (uint32_t)m_video_cc &&
+                (end + sizeof(hdr) > file_size || (data[end] == 0xFF && data[end + 1] == 0xD8)) )
+                break;
+
+            if( hdr.m_four_cc == (uint32_t)m_video_cc )
+                addFrame(m_frames, m_follow_pos + sizeof(hdr), hdr.m_size);
+            m_follow_pos = end + (hdr.m_size & 1);
+        }
     }
 
-    bool isOpened() const
+    void waitForChanges(int timeout_ms)
     {
-        return true;
+#ifdef __linux__
+        if( m_notify_fd >= 0 )
+        {
+            struct pollfd pfd;
+            pfd.fd = m_notify_fd;
+            pfd.events = POLLIN;
+            if( poll(&pfd, 1, timeout_ms) > 0 )
+            {
+                char buf[4096];
+                while( ::read(m_notify_fd, buf, sizeof(buf)) > 0 )
+                    ;
+            }
+            return;
+        }
+#endif
+        // polling of the file size
+        int delay = std::min(timeout_ms, 10);
+#ifdef _WIN32
+        Sleep(delay);
+#else
+        usleep(delay*1000);
+#endif
     }
+
+    MappedFile m_file;
+    AviMainHeader m_avih;
+    AviStreamHeader m_strh;
+    BitmapInfoHeader m_bmih;
+    int m_video_cc;
+    std::vector<FrameRef> m_frames;
+    size_t m_frame_idx;
+    bool m_follow, m_finished;
+    size_t m_follow_pos; // the first chunk of 'movi' that was not added yet
+#ifdef __linux__
+    int m_notify_fd;
+#endif
+    int m_colorspace;
+    Ptr<jpeg::JpegDecoder> m_decoder;
+    double m_fps;
+    bool m_is_opened;
 };
 
-Ptr<MJpegReader> openMJpegReader(const std::string& filename, Size size, double fps, int colorspace)
+Ptr<MJpegReader> openMJpegReader(const std::string& filename, Size size, double fps, int colorspace, bool follow)
 {
-    Ptr<MJpegReader> mjcodec = new MJpegReaderImpl(filename, size, fps, colorspace);
-    //if( mjcodec->isOpened() )
-    //    return mjcodec;
+    Ptr<MJpegReader> mjcodec = new MJpegReaderImpl(filename, size, fps, colorspace, follow);
+    if( mjcodec->isOpened() )
+        return mjcodec;
     return Ptr<MJpegReader>();
 }
 
 }
-}
\ No newline at end of file
+}
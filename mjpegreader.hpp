@@ -2,12 +2,72 @@
 
 #include "opencv2/core/core.hpp"
 #include <string>
+#include <stdint.h>
 
 namespace cv
 {
 namespace mjpeg
 {
 
+typedef uint32_t DWORD;
+typedef uint16_t WORD;
+typedef int32_t  LONG;
+
+#pragma pack(push, 1)
+struct AviMainHeader
+{
+    DWORD dwMicroSecPerFrame;    //  The period between video frames
+    DWORD dwMaxBytesPerSec;      //  Maximum data rate of the file
+    DWORD dwReserved1;           // 0
+    DWORD dwFlags;               //  0x10 AVIF_HASINDEX: The AVI file has an idx1 chunk containing an index at the end of the file.
+    DWORD dwTotalFrames;         // Field of the main header specifies the total number of frames of data in file.
+    DWORD dwInitialFrames;       // Is used for interleaved files
+    DWORD dwStreams;             // Specifies the number of streams in the file.
+    DWORD dwSuggestedBufferSize; // Field specifies the suggested buffer size forreading the file
+    DWORD dwWidth;               // Fields specify the width of the AVIfile in pixels.
+    DWORD dwHeight;              // Fields specify the height of the AVIfile in pixels.
+    DWORD dwReserved[4];         // 0, 0, 0, 0
+};
+
+struct AviStreamHeader
+{
+    uint32_t fccType;              // 'vids', 'auds', 'txts'...
+    uint32_t fccHandler;           // "cvid", "DIB "
+    DWORD dwFlags;               // 0
+    DWORD dwPriority;            // 0
+    DWORD dwInitialFrames;       // 0
+    DWORD dwScale;               // 1
+    DWORD dwRate;                // Fps (dwRate - frame rate for video streams)
+    DWORD dwStart;               // 0
+    DWORD dwLength;              // Frames number (playing time of AVI file as defined by scale and rate)
+    DWORD dwSuggestedBufferSize; // For reading the stream
+    DWORD dwQuality;             // -1 (encoding quality. If set to -1, drivers use the default quality value)
+    DWORD dwSampleSize;          // 0 means that each frame is in its own chunk
+    struct {
+        short int left;
+        short int top;
+        short int right;
+        short int bottom;
+    } rcFrame;                // If stream has a different size than dwWidth*dwHeight(unused)
+};
+
+struct BitmapInfoHeader
+{
+    DWORD biSize;                // Write header size of BITMAPINFO header structure
+    LONG  biWidth;               // width in pixels
+    LONG  biHeight;              // heigth in pixels
+    WORD  biPlanes;              // Number of color planes in which the data is stored
+    WORD  biBitCount;            // Number of bits per pixel
+    DWORD biCompression;         // Type of compression used (uncompressed: NO_COMPRESSION=0)
+    DWORD biSizeImage;           // Image Buffer. Quicktime needs 3 bytes also for 8-bit png
+                                 //   (biCompression==NO_COMPRESSION)?0:xDim*yDim*bytesPerPixel;
+    LONG  biXPelsPerMeter;       // Horizontal resolution in pixels per meter
+    LONG  biYPelsPerMeter;       // Vertical resolution in pixels per meter
+    DWORD biClrUsed;             // 256 (color table size; for 8-bit only)
+    DWORD biClrImportant;        // Specifies that the first x colors of the color table. Are important to the DIB.
+};
+#pragma pack(pop)
+
 class MJpegReader
 {
 public:
@@ -15,9 +75,25 @@ public:
     virtual ~MJpegReader() {};
     virtual bool read(const Mat& img) = 0;
     virtual bool isOpened() const = 0;
+
+    // headers of the file and of its (first) MJPEG video stream
+    virtual const AviMainHeader& getMainHeader() const = 0;
+    virtual const AviStreamHeader& getStreamHeader() const = 0;
+    virtual const BitmapInfoHeader& getBitmapInfoHeader() const = 0;
+    // the number of frames found so far (it grows in follow mode)
+    virtual int getFrameCount() const = 0;
+    virtual double getFps() const = 0;
+
+    // gets the JPEG data of the next frame, valid until the next call. In follow mode
+    // waits up to timeout_ms for the frame to be recorded if it is not in the file yet
+    virtual bool grab(const uchar*& data, size_t& size, int timeout_ms=0) = 0;
 };
 
-Ptr<MJpegReader> openMJpegReader(const std::string& filename, Size size, double fps, int colorspace);
+// size, if not empty, must match the frame size of the file; fps is used if the file does not specify it.
+// In follow mode the file may still be written by MJpegWriter: the frames are read as they are appended
+// (the headers must already be in the file)
+Ptr<MJpegReader> openMJpegReader(const std::string& filename, Size size, double fps, int colorspace,
+                                 bool follow=false);
 
 }
 
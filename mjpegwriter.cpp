@@ -1,12 +1,18 @@
 #include "mjpegwriter.hpp"
+#include "mjpegreader.hpp"
 #include "opencv2/core/core.hpp"
 //#include "opencv2/core/utility.hpp"
 #include <vector>
+#include <cmath>
+#include <cfloat>
 
 //uncomment for real stuff
 //#define WITH_NEON
 #ifdef WITH_NEON
 #include "arm_neon.h"
+#elif defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define WITH_SSE2
+#include <emmintrin.h>
 #endif
 
 namespace cv
@@ -25,6 +31,9 @@ static const int JUNK_SEEK = 4096;
 static const int AVIIF_KEYFRAME = 0x10;
 static const int MAX_BYTES_PER_SEC = 99999999;
 static const int SUG_BUFFER_SIZE = 1048576;
+// the range of the quality (the divisor of the standard quantization tables)
+static const double MIN_QUALITY = 0.25;
+static const double MAX_QUALITY = 12;
 
 static const unsigned bit_mask[] =
 {
@@ -55,6 +64,7 @@ public:
         m_start = &m_buf[0];
         m_end = m_start + DEFAULT_BLOCK_SIZE;
         m_is_opened = false;
+        m_hold = false;
         m_f = 0;
     }
 
@@ -78,14 +88,40 @@ public:
 
     void close()
     {
+        m_hold = false;
         writeBlock();
         if( m_f )
             fclose(m_f);
         m_f = 0;
     }
 
+    // while the data is held, it is kept in the buffer (which grows as needed),
+    // so the stream can be rewound to a position after the start of holding
+    void hold(bool on)
+    {
+        m_hold = on;
+        if( !on && m_current >= m_end )
+            writeBlock();
+    }
+
+    void setPos(size_t pos)
+    {
+        CV_Assert( m_pos <= pos && pos <= getPos() );
+        m_current = m_start + (pos - m_pos);
+    }
+
     void writeBlock()
     {
+        if( m_hold && m_f )
+        {
+            size_t used = m_current - m_start;
+            m_buf.resize(m_buf.size()*2);
+            m_start = &m_buf[0];
+            m_end = m_start + m_buf.size() - 1024;
+            m_current = m_start + used;
+            return;
+        }
+
         size_t wsz0 = m_current - m_start;
         if( wsz0 > 0 && m_f )
         {
@@ -115,6 +151,16 @@ public:
         if( m_current >= m_end )
             writeBlock();
 
+        // large data is written directly rather than copied through the buffer
+        if( count >= DEFAULT_BLOCK_SIZE && !m_hold )
+        {
+            writeBlock();
+            size_t wsz = fwrite(data, 1, count, m_f);
+            CV_Assert( wsz == (size_t)count );
+            m_pos += count;
+            return;
+        }
+
         while( count )
         {
             int l = (int)(m_end - m_current);
@@ -288,19 +334,57 @@ protected:
     uchar*  m_current;
     size_t  m_pos;
     bool    m_is_opened;
+    bool    m_hold;
     FILE*   m_f;
 };
 
 
 MJpegWriter::~MJpegWriter() {}
 
+// checks by the markers before the first scan that the data is a JPEG image of the given size
+static bool checkJpegSize( const uchar* data, size_t len, int width, int height )
+{
+    if( len < 4 || data[0] != 0xFF || data[1] != 0xD8 )
+        return false;
+
+    size_t pos = 2;
+    while( pos + 4 <= len )
+    {
+        int marker = data[pos + 1];
+        if( data[pos] != 0xFF )
+            return false;
+        if( marker == 0xFF ) // fill byte
+        {
+            pos++;
+            continue;
+        }
+        if( marker == 0x01 || (0xD0 <= marker && marker <= 0xD7) ) // standalone markers
+        {
+            pos += 2;
+            continue;
+        }
+        if( marker == 0xDA || marker == 0xD9 ) // SOS or EOI before SOF
+            return false;
+
+        size_t length = data[pos + 2]*256 + data[pos + 3];
+        // SOF0..SOF15, except DHT, JPG and DAC
+        if( 0xC0 <= marker && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC )
+            return length >= 8 && pos + 9 <= len &&
+                   data[pos + 5]*256 + data[pos + 6] == height &&
+                   data[pos + 7]*256 + data[pos + 8] == width;
+        pos += 2 + length;
+    }
+    return false;
+}
+
 class MJpegWriterImpl : public MJpegWriter
 {
 public:
-    MJpegWriterImpl() { rawstream = false; }
+    MJpegWriterImpl() { rawstream = false; inFrame = false; }
     MJpegWriterImpl(const std::string& filename, Size size, double fps, int _colorspace)
     {
         rawstream = false;
+        inFrame = false;
         open(filename, size, fps, _colorspace);
     }
     ~MJpegWriterImpl() { close(); }
@@ -310,6 +394,11 @@ public:
         if( !strm.isOpened() )
             return;
 
+        // an unfinished frame is left out of the index
+        if( inFrame && !rawstream )
+            endWriteChunk(); // end '00dc'
+        inFrame = false;
+
         if( !frameOffset.empty() && !rawstream )
         {
             endWriteChunk(); // end LIST 'movi'
@@ -334,10 +423,22 @@ public:
         outfps = cvRound(fps);
         width = size.width;
         height = size.height;
-        quality = 3;
+        baseQuality = quality = 3;
+        qtabQuality = 0;
+        targetFrameSize = 0;
+        maxFrameSize = 0;
+        dupMode = DUPLICATES_ENCODE;
+        dupStep = 1;
+        lastHashValid = false;
+        avi1 = false;
+        precision = 8;
+        rdo = false;
         rawstream = false;
         colorspace = _colorspace;
         channels = colorspace == COLORSPACE_GRAY ? 1 : 3;
+        // the packed 4:2:2 formats have the chroma for pairs of pixels
+        CV_Assert( (colorspace != COLORSPACE_YUYV && colorspace != COLORSPACE_UYVY) || width % 2 == 0 );
+        rowBuffer.release();
 
         if( !rawstream )
         {
@@ -504,7 +605,6 @@ public:
 
     bool write(const Mat& img)
     {
-        size_t chunkPointer = strm.getPos();
         int input_channels = img.channels();
 
         if( colorspace == COLORSPACE_GRAY )
@@ -523,33 +623,389 @@ public:
         {
             CV_Assert( img.cols == width && img.rows == height*3 && input_channels == 1 );
         }
+        else if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+        {
+            CV_Assert( img.cols == ((width + 1) & -2) && img.rows == ((height + 1) & -2)*3/2 &&
+                       input_channels == 1 );
+        }
+        else if( colorspace == COLORSPACE_YUYV || colorspace == COLORSPACE_UYVY )
+        {
+            CV_Assert( img.cols == width && img.rows == height && input_channels == 2 );
+        }
+        CV_Assert( img.depth() == (precision > 8 ? CV_16U : CV_8U) );
+
+        uint64 hash = 0;
+        if( dupMode != DUPLICATES_ENCODE && !rawstream )
+        {
+            hash = hashFrame(img);
+            if( lastHashValid && hash == lastHash )
+            {
+                writeDuplicate();
+                return true;
+            }
+        }
+
+        if( maxFrameSize == 0 )
+        {
+            if( !(beginFrame() && writeRows(img) && endFrame()) )
+                return false;
+            lastHash = hash;
+            lastHashValid = dupMode != DUPLICATES_ENCODE && !rawstream;
+            return true;
+        }
+
+        // the frame is kept in memory until it fits into the limit
+        strm.hold(true);
+        for(;;)
+        {
+            beginFrame();
+            writeRows(img);
+            writeFrameEnd();
+            inFrame = false;
+
+            size_t size = getFrameSize();
+            if( size <= maxFrameSize || quality <= MIN_QUALITY )
+                break;
+
+            // encode it again at lower quality
+            if( !rawstream )
+                AVIChunkSizeIndex.pop_back();
+            strm.setPos(chunkPointer);
+            quality = roundQuality(quality*std::max(maxFrameSize*0.9/size, 0.5));
+        }
+        addFrame();
+        strm.hold(false);
+        lastHash = hash;
+        lastHashValid = dupMode != DUPLICATES_ENCODE && !rawstream;
+        return true;
+    }
+
+    void setAVI1(bool _avi1)
+    {
+        avi1 = _avi1;
+    }
+
+    void setPrecision(int bits)
+    {
+        CV_Assert( !inFrame && (bits == 8 || (bits == 12 && (colorspace == COLORSPACE_GRAY ||
+                                                             colorspace == COLORSPACE_YUV444P))) );
+        precision = bits;
+    }
+
+    void setRDOQuantization(bool _rdo)
+    {
+        rdo = _rdo;
+    }
+
+    bool writeCompressed(const uchar* jpeg, size_t len)
+    {
+        CV_Assert( !inFrame && jpeg && len <= (size_t)INT_MAX );
+        if( !checkJpegSize(jpeg, len, width, height) )
+            return false;
+
+        chunkPointer = strm.getPos();
+        lastHashValid = false;
+        if( !rawstream )
+            startWriteChunk(fourCC('0', '0', 'd', 'c'));
+        strm.putBytes(jpeg, (int)len);
+        padFrame();
+        addFrame();
+        return true;
+    }
+
+    // the frames are padded with zeros to 4 bytes
+    void padFrame()
+    {
+        size_t pos = strm.getPos();
+        size_t pos1 = (pos + 3) & ~3;
+        for( ; pos < pos1; pos++ )
+            strm.putByte(0);
+    }
+
+    void setDuplicateFrames(int mode, int sample_step)
+    {
+        CV_Assert( (mode == DUPLICATES_ENCODE || mode == DUPLICATES_REUSE || mode == DUPLICATES_EMPTY) &&
+                   sample_step >= 1 );
+        dupMode = mode;
+        dupStep = sample_step;
+        lastHashValid = false;
+    }
+
+    // a hash of the rows of the frame sampled by dupStep
+    uint64 hashFrame(const Mat& img) const;
+
+    // indexes the frame written last once more instead of a duplicate of it
+    void writeDuplicate()
+    {
+        if( dupMode == DUPLICATES_REUSE )
+        {
+            frameOffset.push_back(frameOffset.back());
+            frameSize.push_back(frameSize.back());
+        }
+        else
+        {
+            frameOffset.push_back(strm.getPos() - moviPointer);
+            frameSize.push_back(0);
+            startWriteChunk(fourCC('0', '0', 'd', 'c'));
+            endWriteChunk(); // end '00dc'
+        }
+    }
+
+    void setRateControl(double bitrate, size_t max_frame_size)
+    {
+        CV_Assert( bitrate >= 0 );
+        targetFrameSize = bitrate/(8*outfps);
+        maxFrameSize = max_frame_size;
+        rateBuffer = 0;
+        if( targetFrameSize == 0 && maxFrameSize == 0 )
+            quality = baseQuality;
+    }
+
+    bool beginFrame()
+    {
+        CV_Assert( !inFrame );
+        chunkPointer = strm.getPos();
+        lastHashValid = false;
+        frameBlocks.clear();
 
         if( !rawstream )
             startWriteChunk(fourCC('0', '0', 'd', 'c'));
 
-        writeFrameData(img.data, (int)img.step, width, height, input_channels);
+        writeFrameHeader();
+        inFrame = true;
+        frameRows = pendingRows = 0;
+        return true;
+    }
+
+    bool writeRows(const Mat& rows)
+    {
+        bool yuv420 = colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420;
+        int input_channels = rows.channels();
+        int y_step = channels > 1 ? 16 : 8;
+        // the rows of the frame in the strip; 4:2:0 strips have even number of rows
+        // (rounded up at the bottom of the frame)
+        int count = colorspace == COLORSPACE_YUV444P ? rows.rows/3 : yuv420 ? rows.rows/3*2 : rows.rows;
+        int planes_rows = colorspace == COLORSPACE_YUV444P ? count*3 : yuv420 ? count*3/2 : count;
+        int cols = yuv420 ? (width + 1) & -2 : width;
+        int cn = colorspace == COLORSPACE_RGBA ? 4 : colorspace == COLORSPACE_BGR ? 3 :
+                 colorspace == COLORSPACE_YUYV || colorspace == COLORSPACE_UYVY ? 2 : 1;
+
+        CV_Assert( inFrame && rows.cols == cols && rows.rows == planes_rows && input_channels == cn &&
+                   rows.depth() == (precision > 8 ? CV_16U : CV_8U) );
+        if( yuv420 )
+            count = std::min(count, height - frameRows);
+        CV_Assert( frameRows + count <= height );
+
+        const uchar* planes[3];
+        int uv_step, step = (int)rows.step;
+        getPlanes(rows, planes_rows, planes, uv_step);
+
+        for( int i = 0; i < count; )
+        {
+            if( pendingRows == 0 )
+            {
+                // the complete MCU rows are encoded from the input
+                int n = frameRows + (count - i) == height ? count - i : (count - i) & -y_step;
+                if( n > 0 )
+                {
+                    const uchar* ptrs[] = { planes[0] + i*step, 0, 0 };
+                    int uv_ofs = (yuv420 ? i/2 : i)*uv_step;
+                    if( planes[1] )
+                        ptrs[1] = planes[1] + uv_ofs, ptrs[2] = planes[2] + uv_ofs;
+                    writeMCURows(ptrs, step, uv_step, n, input_channels);
+                    i += n;
+                    frameRows += n;
+                    continue;
+                }
+            }
+
+            // a part of an MCU row is kept until the rest of it comes
+            int mcu_rows = std::min(y_step, height - (frameRows - pendingRows));
+            int n = std::min(mcu_rows - pendingRows, count - i);
+            int buf_rows = colorspace == COLORSPACE_YUV444P ? y_step*3 : yuv420 ? y_step*3/2 : y_step;
+            const uchar* buf_planes[3];
+            int buf_uv_step;
+
+            rowBuffer.create(buf_rows, rows.cols, rows.type());
+            getPlanes(rowBuffer, buf_rows, buf_planes, buf_uv_step);
+            for( int p = 0; p < 3 && planes[p]; p++ )
+            {
+                // the rows of the plane covering the rows [i, i + n) of the strip
+                int sh = p > 0 && yuv420, r0 = pendingRows >> sh, r1 = (pendingRows + n + sh) >> sh;
+                int sstep = p > 0 ? uv_step : step, dstep = p > 0 ? buf_uv_step : (int)rowBuffer.step;
+                int row_size = (p == 0 ? cols*cn : colorspace == COLORSPACE_I420 ? cols/2 : cols)*
+                               (int)rows.elemSize1();
+                if( p == 2 && colorspace == COLORSPACE_NV12 )
+                    break; // U and V are interleaved
+                for( int r = r0; r < r1; r++ )
+                    memcpy( (uchar*)buf_planes[p] + dstep*r, planes[p] + sstep*((i >> sh) + r - r0), row_size );
+            }
+            i += n;
+            frameRows += n;
+            pendingRows += n;
+
+            if( pendingRows == mcu_rows )
+            {
+                writeMCURows(buf_planes, (int)rowBuffer.step, buf_uv_step, mcu_rows, input_channels);
+                pendingRows = 0;
+            }
+        }
+        return true;
+    }
+
+    // the planes of the rows in the input format: Y (or the pixels), U and V (with uv_step)
+    void getPlanes(const Mat& rows, int planes_rows, const uchar** planes, int& uv_step) const
+    {
+        int step = (int)rows.step;
+        planes[0] = rows.data;
+        planes[1] = planes[2] = 0;
+        uv_step = step;
+
+        if( colorspace == COLORSPACE_YUV444P )
+        {
+            planes[1] = rows.data + step*(planes_rows/3);
+            planes[2] = planes[1] + step*(planes_rows/3);
+        }
+        else if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+        {
+            int luma_rows = planes_rows/3*2;
+            planes[1] = rows.data + step*luma_rows;
+            if( colorspace == COLORSPACE_NV12 )
+                planes[2] = planes[1] + 1;
+            else
+            {
+                uv_step = step/2;
+                planes[2] = planes[1] + uv_step*(luma_rows/2);
+            }
+        }
+    }
+
+    bool endFrame()
+    {
+        CV_Assert( inFrame && frameRows == height );
+        writeFrameEnd();
+        inFrame = false;
+        addFrame();
+        return true;
+    }
+
+    // the size of the JPEG data of the frame written last
+    size_t getFrameSize() const
+    {
+        return strm.getPos() - chunkPointer - (rawstream ? 0 : 8);
+    }
 
+    // ends the chunk of the frame written and adds it to the index
+    void addFrame()
+    {
+        size_t size = getFrameSize();
         if( !rawstream )
         {
             frameOffset.push_back(chunkPointer - moviPointer);
-            frameSize.push_back(strm.getPos() - chunkPointer - 8);       // Size excludes '00dc' and size field
+            frameSize.push_back(size);       // Size excludes '00dc' and size field
             endWriteChunk(); // end '00dc'
         }
+        updateQuality(size);
+    }
 
-        return true;
+    // the quality levels are 1/8 octave apart, so the tables change only on notable size changes
+    static double roundQuality(double q)
+    {
+        q = std::min(std::max(q, MIN_QUALITY), MAX_QUALITY);
+        return std::pow(2., cvRound(std::log(q)/std::log(2.)*8)/8.);
+    }
+
+    // rate control: sets the quality of the next frame from the size of the last one,
+    // considering the frame size to be about proportional to the quality
+    void updateQuality(size_t size)
+    {
+        double target = targetFrameSize;
+        if( target > 0 )
+        {
+            // the bytes over (or under) the budget are made up for in about a second
+            rateBuffer = std::min(std::max(rateBuffer + (double)size - target, -target*outfps), target*outfps);
+            target = std::max(target - rateBuffer/outfps, target*0.25);
+        }
+        else if( maxFrameSize > 0 )
+            target = baseQuality*size/quality; // back to the base quality when the frames get smaller
+        else
+            return;
+
+        if( maxFrameSize > 0 )
+            target = std::min(target, maxFrameSize*0.75);
+        double q = quality*std::min(std::max(target/std::max(size, (size_t)1), 0.5), 2.);
+        quality = targetFrameSize > 0 || q < baseQuality ? roundQuality(q) : baseQuality;
     }
 
-    void writeFrameData( const uchar* data, int step, int width, int height, int input_channels );
+    // sampling is h*16 + v of each component, the sampling of the writer if it is 0
+    void writeFrameHeader( const int* sampling = 0 );
+    // the SOS marker and the start of the entropy-coded data
+    void writeScanHeader();
+    // builds the encoding table from htable (the counts of the codes by length, then the symbols),
+    // writes it in DHT if put is set
+    void setHuffmanTable( const uchar* htable, int is_ac_tab, int idx, bool put );
+    void writeBlock( const short* block, int c, int table, unsigned& currval, int& bit_idx );
+    // chooses the levels of the coefficients (with rdofrac fractional bits, in the order of the block)
+    // that minimize the distortion + lambda*bits under the Huffman tables (see setRDOQuantization)
+    void rdoQuantizeBlock( const int* coeffs, short* block, int table );
+    // encodes the rows of MCUs (the last one may be incomplete only at the bottom of the frame)
+    // from the planes returned by getPlanes
+    void writeMCURows( const uchar* const* planes, int step, int uv_step, int height, int input_channels );
+    // the same for 12-bit frames: the blocks are quantized into frameBlocks,
+    // writeFrameEnd encodes them with the Huffman tables optimized for them
+    void writeMCURows12( const uchar* const* planes, int step, int height );
+    void writeOptimizedScan();
+    void writeFrameEnd();
+
+    // writes a frame of the requantized coefficients of a JPEG image of the same size
+    // and number of components (see transcodeMJpeg)
+    bool writeCoefficients( const jpeg::JpegCoefficients& src );
+
+    void setQuality( double q )
+    {
+        baseQuality = quality = q;
+    }
 
 protected:
     int outfps;
     int width, height, channels;
-    int quality;
+    double quality, baseQuality;
     size_t moviPointer;
     std::vector<size_t> frameOffset, frameSize, AVIChunkSizeIndex, frameNumIndexes;
     int colorspace;
     bool rawstream;
 
+    // the frame being written
+    bool inFrame;
+    size_t chunkPointer;
+    int frameRows, pendingRows; // the rows passed so far and the part of them kept in rowBuffer
+    Mat rowBuffer;
+    double qtabQuality; // the quality the quantization tables are computed for
+    uchar qtab[2][64];
+    short fdct_qtab[2][64];
+    int fdct_qtab32[2][64]; // the postscale of the 32-bit FDCT
+    float rdoWeight[2][64]; // the squared quantization steps relative to the luma DC one (16/quality)
+    unsigned huff_dc_tab[2][16 + 2];
+    unsigned huff_ac_tab[2][256 + 2];
+    int dc_pred[3];
+    unsigned bitValue; // the bits not written yet
+    int bitIdx;
+
+    // rate control (see setRateControl)
+    double targetFrameSize;
+    size_t maxFrameSize;
+    double rateBuffer; // the bytes written over the target so far
+
+    // duplicate frames (see setDuplicateFrames)
+    int dupMode, dupStep;
+    uint64 lastHash;
+    bool lastHashValid; // the hash of the frame written last is known
+
+    bool avi1; // the frames are written without the Huffman tables (see setAVI1)
+    int precision; // the sample precision of the frames (see setPrecision)
+    bool rdo; // RDO quantization (see setRDOQuantization)
+    std::vector<short> frameBlocks; // the quantized blocks of the 12-bit frame being written
+
     BitStream strm;
 };
 
@@ -560,7 +1016,9 @@ enum
 {
     fixb = 14,
     fixc = 12,
-    postshift = 14
+    postshift = 14,
+    postshift32 = 24,
+    rdofrac = 8
 };
 
 static const int C0_707 = fix(0.707106781f, fixb);
@@ -707,6 +1165,17 @@ static const char jpegHeader[] =
 "\x00\x01\x00\x01" // 2 2-bytes values: x density & y density
 "\x00\x00"; // width & height of thumbnail: ( 0x0 means no thumbnail)
 
+// the header of AVI1 frames, which have the standard Huffman tables implied
+static const char avi1Header[] =
+"\xFF\xD8"  // SOI  - start of image
+"\xFF\xE0"  // APP0 - AVI1 extension
+"\x00\x10"  // 2 bytes: length of APP0 segment
+"AVI1"      // AVI1 signature
+"\x00"      // polarity: not interlaced
+"\x00"      // reserved
+"\x00\x00\x00\x00"  // field size (unknown)
+"\x00\x00\x00\x00"; // field size without padding (unknown)
+
 #ifdef WITH_NEON
 // FDCT with postscaling
 static void aan_fdct8x8( const short *src, short *dst,
@@ -1018,157 +1487,591 @@ static void aan_fdct8x8( const short *src, short *dst,
 }
 #endif
 
-void MJpegWriterImpl::writeFrameData( const uchar* data, int step,
-                                      int width, int height, int input_channels )
+// FDCT with postscaling of 12-bit samples or with the fractional bits of the result: the same as above
+// in 32 bits, the products are 64-bit. The result is descaled by shift (postshift32 for the integers)
+static void aan_fdct8x8_32( const short *src, int *dst,
+                            int step, const int *postscale, int shift )
 {
-    //double total_cvt = 0, total_dct = 0;
-    static bool init_cat_table = false;
-    const int CAT_TAB_SIZE = 4096;
-    static uchar cat_table[CAT_TAB_SIZE*2+1];
-    if( !init_cat_table )
+    int  workspace[64], *work = workspace;
+    int  i;
+
+    // Pass 1: process rows
+    for( i = 8; i > 0; i--, src += step, work += 8 )
     {
-        for( int i = -CAT_TAB_SIZE; i <= CAT_TAB_SIZE; i++ )
-        {
-            float a = (float)i;
-            cat_table[i+CAT_TAB_SIZE] = (((int&)a >> 23) & 255) - (126 & (i ? -1 : 0));
-        }
-        init_cat_table = true;
-    }
+        int x0 = src[0], x1 = src[7];
+        int x2 = src[3], x3 = src[4];
 
-    //double total_dct = 0, total_cvt = 0;
-    CV_Assert( data && width > 0 && height > 0 );
+        int x4 = x0 + x1; x0 -= x1;
+        x1 = x2 + x3; x2 -= x3;
 
-    // encode the header and tables
-    // for each mcu:
-    //   convert rgb to yuv with downsampling (if color).
-    //   for every block:
-    //     calc dct and quantize
-    //     encode block.
-    int x, y;
-    int i, j;
-    const int max_quality = 12;
-    short fdct_qtab[2][64];
-    unsigned huff_dc_tab[2][16];
-    unsigned huff_ac_tab[2][256];
+        work[7] = x0; work[1] = x2;
+        x2 = x4 + x1; x4 -= x1;
 
-    int  x_scale = channels > 1 ? 2 : 1, y_scale = x_scale;
-    int  dc_pred[] = { 0, 0, 0 };
-    int  x_step = x_scale * 8;
-    int  y_step = y_scale * 8;
-    short  block[6][64];
-    short  buffer[4096];
-    int*   hbuffer = (int*)buffer;
-    int  luma_count = x_scale*y_scale;
-    int  block_count = luma_count + channels - 1;
-    int  Y_step = x_scale*8;
-    const int UV_step = 16;
-    int u_plane_ofs = step*height;
-    int v_plane_ofs = u_plane_ofs + step*height;
+        x0 = src[1]; x3 = src[6];
+        x1 = x0 + x3; x0 -= x3;
+        work[5] = x0;
 
-    if( quality < 1 ) quality = 1;
-    if( quality > max_quality ) quality = max_quality;
+        x0 = src[2]; x3 = src[5];
+        work[3] = x0 - x3; x0 += x3;
 
-    double inv_quality = 1./quality;
+        x3 = x0 + x1; x0 -= x1;
+        x1 = x2 + x3; x2 -= x3;
 
-    // Encode header
-    strm.putBytes( (const uchar*)jpegHeader, sizeof(jpegHeader) - 1 );
+        work[0] = x1; work[4] = x2;
 
-    // Encode quantization tables
-    for( i = 0; i < (channels > 1 ? 2 : 1); i++ )
-    {
-        const uchar* qtable = i == 0 ? jpegTableK1_T : jpegTableK2_T;
-        int chroma_scale = i > 0 ? luma_count : 1;
+        x0 = (int)DCT_DESCALE((int64)(x0 - x4)*C0_707, fixb);
+        x1 = x4 + x0; x4 -= x0;
+        work[2] = x4; work[6] = x1;
 
-        strm.jputShort( 0xffdb );   // DQT marker
-        strm.jputShort( 2 + 65*1 ); // put single qtable
-        strm.putByte( 0*16 + i );   // 8-bit table
+        x0 = work[1]; x1 = work[3];
+        x2 = work[5]; x3 = work[7];
 
-        // put coefficients
-        for( j = 0; j < 64; j++ )
-        {
-            int idx = zigzag[j];
-            int qval = cvRound(qtable[idx]*inv_quality);
-            if( qval < 1 )
-                qval = 1;
-            if( qval > 255 )
-                qval = 255;
-            fdct_qtab[i][(idx/8) + (idx%8)*8] = (cvRound((1 << (postshift + 11)))/
-                                        (qval*chroma_scale*idct_prescale[idx]));
-            strm.putByte( qval );
-        }
-    }
+        x0 += x1; x1 += x2; x2 += x3;
+        x1 = (int)DCT_DESCALE((int64)x1*C0_707, fixb);
 
-    // Encode huffman tables
-    for( i = 0; i < (channels > 1 ? 4 : 2); i++ )
-    {
-        const uchar* htable = i == 0 ? jpegTableK3 : i == 1 ? jpegTableK5 :
-        i == 2 ? jpegTableK4 : jpegTableK6;
-        int is_ac_tab = i & 1;
-        int idx = i >= 2;
-        int tableSize = 16 + (is_ac_tab ? 162 : 12);
+        x4 = x1 + x3; x3 -= x1;
+        int64 x5 = (int64)(x0 - x2)*C0_382;
+        x0 = (int)DCT_DESCALE((int64)x0*C0_541 + x5, fixb);
+        x2 = (int)DCT_DESCALE((int64)x2*C1_306 + x5, fixb);
 
-        strm.jputShort( 0xFFC4 );      // DHT marker
-        strm.jputShort( 3 + tableSize ); // define one huffman table
-        strm.putByte( is_ac_tab*16 + idx ); // put DC/AC flag and table index
-        strm.putBytes( htable, tableSize ); // put table
+        x1 = x0 + x3; x3 -= x0;
+        x0 = x4 + x2; x4 -= x2;
 
-        BitStream::createEncodeHuffmanTable( BitStream::createSourceHuffmanTable(
-                            htable, hbuffer, 16, 9 ), is_ac_tab ? huff_ac_tab[idx] :
-                            huff_dc_tab[idx], is_ac_tab ? 256 : 16 );
+        work[5] = x1; work[1] = x0;
+        work[7] = x4; work[3] = x3;
     }
 
-    // put frame header
-    strm.jputShort( 0xFFC0 );          // SOF0 marker
-    strm.jputShort( 8 + 3*channels );  // length of frame header
-    strm.putByte( 8 );               // sample precision
-    strm.jputShort( height );
-    strm.jputShort( width );
-    strm.putByte( channels );        // number of components
-
-    for( i = 0; i < channels; i++ )
+    work = workspace;
+    // pass 2: process columns
+    for( i = 8; i > 0; i--, work++, postscale ++, dst += 8 )
     {
-        strm.putByte( i + 1 );  // (i+1)-th component id (Y,U or V)
-        if( i == 0 )
-            strm.putByte(x_scale*16 + y_scale); // chroma scale factors
-        else
-            strm.putByte(1*16 + 1);
-        strm.putByte( i > 0 ); // quantization table idx
-    }
+        int  x0 = work[8*0], x1 = work[8*7];
+        int  x2 = work[8*3], x3 = work[8*4];
 
-    // put scan header
-    strm.jputShort( 0xFFDA );          // SOS marker
-    strm.jputShort( 6 + 2*channels );  // length of scan header
-    strm.putByte( channels );          // number of components in the scan
+        int  x4 = x0 + x1; x0 -= x1;
+        x1 = x2 + x3; x2 -= x3;
 
-    for( i = 0; i < channels; i++ )
-    {
-        strm.putByte( i+1 );             // component id
-        strm.putByte( (i>0)*16 + (i>0) );// selection of DC & AC tables
-    }
+        work[8*7] = x0; work[8*0] = x2;
+        x2 = x4 + x1; x4 -= x1;
 
-    strm.jputShort(0*256 + 63); // start and end of spectral selection - for
-                                // sequental DCT start is 0 and end is 63
+        x0 = work[8*1]; x3 = work[8*6];
+        x1 = x0 + x3; x0 -= x3;
+        work[8*4] = x0;
 
-    strm.putByte( 0 );  // successive approximation bit position
-                        // high & low - (0,0) for sequental DCT
-    unsigned currval = 0, code = 0, tempval = 0;
-    int bit_idx = 32;
-
-    #define JPUT_BITS(val, bits) \
-        bit_idx -= (bits); \
-        tempval = (val) & bit_mask[(bits)]; \
-        if( bit_idx <= 0 ) \
-        {  \
-            strm.jput(currval | ((unsigned)tempval >> -bit_idx)); \
-            bit_idx += 32; \
-            currval = bit_idx < 32 ? (tempval << bit_idx) : 0; \
-        } \
-        else \
-            currval |= (tempval << bit_idx)
-
-    #define JPUT_HUFF(val, table) \
-        code = table[(val) + 2]; \
-        JPUT_BITS(code >> 8, (int)(code & 255))
+        x0 = work[8*2]; x3 = work[8*5];
+        work[8*3] = x0 - x3; x0 += x3;
+
+        x3 = x0 + x1; x0 -= x1;
+        x1 = x2 + x3; x2 -= x3;
+
+        dst[0] = (int)DCT_DESCALE((int64)x1*postscale[0*8], shift);
+        dst[4] = (int)DCT_DESCALE((int64)x2*postscale[4*8], shift);
+
+        x0 = (int)DCT_DESCALE((int64)(x0 - x4)*C0_707, fixb);
+        x1 = x4 + x0; x4 -= x0;
+
+        dst[2] = (int)DCT_DESCALE((int64)x4*postscale[2*8], shift);
+        dst[6] = (int)DCT_DESCALE((int64)x1*postscale[6*8], shift);
+
+        x0 = work[8*0]; x1 = work[8*3];
+        x2 = work[8*4]; x3 = work[8*7];
+
+        x0 += x1; x1 += x2; x2 += x3;
+        x1 = (int)DCT_DESCALE((int64)x1*C0_707, fixb);
+
+        x4 = x1 + x3; x3 -= x1;
+        int64 x5 = (int64)(x0 - x2)*C0_382;
+        x0 = (int)DCT_DESCALE((int64)x0*C0_541 + x5, fixb);
+        x2 = (int)DCT_DESCALE((int64)x2*C1_306 + x5, fixb);
+
+        x1 = x0 + x3; x3 -= x0;
+        x0 = x4 + x2; x4 -= x2;
+
+        dst[5] = (int)DCT_DESCALE((int64)x1*postscale[5*8], shift);
+        dst[1] = (int)DCT_DESCALE((int64)x0*postscale[1*8], shift);
+        dst[7] = (int)DCT_DESCALE((int64)x4*postscale[7*8], shift);
+        dst[3] = (int)DCT_DESCALE((int64)x3*postscale[3*8], shift);
+    }
+}
+
+// copies a 16x16 MCU of 4:2:0 input (u and v have uv_cn channels: 2 for NV12, 1 for I420)
+// into the Y and the Cb|Cr rows of the blocks; the chroma is scaled as the sum of 2x2 samples
+static void loadYUV420( const uchar* y, int step, const uchar* u, const uchar* v, int uv_step, int uv_cn,
+                        short* Y_data, short* UV_data, int x_limit, int y_limit )
+{
+    int i, j;
+    for( i = 0; i < y_limit; i++, y += step, Y_data += 16 )
+    {
+        j = 0;
+#if defined WITH_SSE2
+        if( x_limit == 16 )
+        {
+            __m128i z = _mm_setzero_si128(), delta = _mm_set1_epi16(128);
+            __m128i t = _mm_loadu_si128((const __m128i*)y);
+            _mm_storeu_si128((__m128i*)Y_data, _mm_sub_epi16(_mm_unpacklo_epi8(t, z), delta));
+            _mm_storeu_si128((__m128i*)(Y_data + 8), _mm_sub_epi16(_mm_unpackhi_epi8(t, z), delta));
+            j = 16;
+        }
+#elif defined WITH_NEON
+        if( x_limit == 16 )
+        {
+            uint8x16_t t = vld1q_u8(y);
+            int16x8_t delta = vdupq_n_s16(128);
+            vst1q_s16(Y_data, vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(t))), delta));
+            vst1q_s16(Y_data + 8, vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(t))), delta));
+            j = 16;
+        }
+#endif
+        for( ; j < x_limit; j++ )
+            Y_data[j] = (short)(y[j] - 128);
+    }
+
+    for( i = 0; i < y_limit; i += 2, u += uv_step, v += uv_step, UV_data += 16 )
+    {
+        j = 0;
+#if defined WITH_SSE2
+        if( x_limit == 16 )
+        {
+            __m128i z = _mm_setzero_si128(), delta = _mm_set1_epi16(128*4), tu, tv;
+            if( uv_cn == 2 )
+            {
+                __m128i t = _mm_loadu_si128((const __m128i*)u);
+                tu = _mm_and_si128(t, _mm_set1_epi16(255));
+                tv = _mm_srli_epi16(t, 8);
+            }
+            else
+            {
+                tu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)u), z);
+                tv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)v), z);
+            }
+            _mm_storeu_si128((__m128i*)UV_data, _mm_sub_epi16(_mm_slli_epi16(tu, 2), delta));
+            _mm_storeu_si128((__m128i*)(UV_data + 8), _mm_sub_epi16(_mm_slli_epi16(tv, 2), delta));
+            j = 8;
+        }
+#elif defined WITH_NEON
+        if( x_limit == 16 )
+        {
+            uint8x8_t tu, tv;
+            if( uv_cn == 2 )
+            {
+                uint8x8x2_t t = vld2_u8(u);
+                tu = t.val[0];
+                tv = t.val[1];
+            }
+            else
+            {
+                tu = vld1_u8(u);
+                tv = vld1_u8(v);
+            }
+            int16x8_t delta = vdupq_n_s16(128*4);
+            vst1q_s16(UV_data, vsubq_s16(vshlq_n_s16(vreinterpretq_s16_u16(vmovl_u8(tu)), 2), delta));
+            vst1q_s16(UV_data + 8, vsubq_s16(vshlq_n_s16(vreinterpretq_s16_u16(vmovl_u8(tv)), 2), delta));
+            j = 8;
+        }
+#endif
+        for( ; j < (x_limit + 1)/2; j++ )
+        {
+            UV_data[j] = (short)(u[j*uv_cn]*4 - 128*4);
+            UV_data[j + 8] = (short)(v[j*uv_cn]*4 - 128*4);
+        }
+    }
+}
+
+// copies a 16x16 MCU of YUYV (or UYVY if uyvy is set) input into the blocks as loadYUV420 does;
+// the chroma of a pair of rows is summed, the last row of an odd height counts twice
+static void loadYUV422( const uchar* src, int step, bool uyvy,
+                        short* Y_data, short* UV_data, int x_limit, int y_limit )
+{
+    int i, j;
+    int y_ofs = uyvy, u_ofs = 1 - uyvy, v_ofs = 3 - uyvy;
+    for( i = 0; i < y_limit; i++, src += step, Y_data += 16 )
+    {
+        short* uv = UV_data + (i >> 1)*16;
+        int scale = (i & 1) || i + 1 < y_limit ? 2 : 4;
+        j = 0;
+#if defined WITH_SSE2
+        if( x_limit == 16 )
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)src);
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+            __m128i mask = _mm_set1_epi16(255), delta = _mm_set1_epi16(128), ya, yb;
+            if( uyvy )
+            {
+                ya = _mm_srli_epi16(a, 8), a = _mm_and_si128(a, mask);
+                yb = _mm_srli_epi16(b, 8), b = _mm_and_si128(b, mask);
+            }
+            else
+            {
+                ya = _mm_and_si128(a, mask), a = _mm_srli_epi16(a, 8);
+                yb = _mm_and_si128(b, mask), b = _mm_srli_epi16(b, 8);
+            }
+            _mm_storeu_si128((__m128i*)Y_data, _mm_sub_epi16(ya, delta));
+            _mm_storeu_si128((__m128i*)(Y_data + 8), _mm_sub_epi16(yb, delta));
+
+            // a and b are U0 V0 U1 V1 ..., separate U and V
+            __m128i mask32 = _mm_set1_epi32(65535);
+            __m128i tu = _mm_packs_epi32(_mm_and_si128(a, mask32), _mm_and_si128(b, mask32));
+            __m128i tv = _mm_packs_epi32(_mm_srli_epi32(a, 16), _mm_srli_epi32(b, 16));
+            __m128i s = _mm_cvtsi32_si128(scale >> 1), cdelta = _mm_set1_epi16((short)(128*scale));
+            tu = _mm_sub_epi16(_mm_sll_epi16(tu, s), cdelta);
+            tv = _mm_sub_epi16(_mm_sll_epi16(tv, s), cdelta);
+            _mm_storeu_si128((__m128i*)uv, _mm_add_epi16(_mm_loadu_si128((const __m128i*)uv), tu));
+            _mm_storeu_si128((__m128i*)(uv + 8), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(uv + 8)), tv));
+            j = 16;
+        }
+#elif defined WITH_NEON
+        if( x_limit == 16 )
+        {
+            uint8x16x2_t t = vld2q_u8(src);
+            uint8x16_t ty = t.val[uyvy], tc = t.val[1 - uyvy];
+            int16x8_t delta = vdupq_n_s16(128);
+            vst1q_s16(Y_data, vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(ty))), delta));
+            vst1q_s16(Y_data + 8, vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(ty))), delta));
+
+            uint8x8x2_t c = vuzp_u8(vget_low_u8(tc), vget_high_u8(tc));
+            int16x8_t tu = vreinterpretq_s16_u16(vmovl_u8(c.val[0]));
+            int16x8_t tv = vreinterpretq_s16_u16(vmovl_u8(c.val[1]));
+            int16x8_t sc = vdupq_n_s16((short)scale), cdelta = vdupq_n_s16((short)(128*scale));
+            vst1q_s16(uv, vaddq_s16(vld1q_s16(uv), vsubq_s16(vmulq_s16(tu, sc), cdelta)));
+            vst1q_s16(uv + 8, vaddq_s16(vld1q_s16(uv + 8), vsubq_s16(vmulq_s16(tv, sc), cdelta)));
+            j = 16;
+        }
+#endif
+        for( ; j < x_limit; j += 2 )
+        {
+            const uchar* p = src + j*2;
+            Y_data[j] = (short)(p[y_ofs] - 128);
+            Y_data[j + 1] = (short)(p[y_ofs + 2] - 128);
+            uv[j >> 1] = (short)(uv[j >> 1] + (p[u_ofs] - 128)*scale);
+            uv[(j >> 1) + 8] = (short)(uv[(j >> 1) + 8] + (p[v_ofs] - 128)*scale);
+        }
+    }
+}
+
+// the DC differences of 12-bit samples are up to 2^15
+static const int CAT_TAB_SIZE = 32768;
+static uchar cat_table[CAT_TAB_SIZE*2+1];
+
+#define JPUT_BITS(val, bits) \
+    bit_idx -= (bits); \
+    tempval = (val) & bit_mask[(bits)]; \
+    if( bit_idx <= 0 ) \
+    {  \
+        strm.jput(currval | ((unsigned)tempval >> -bit_idx)); \
+        bit_idx += 32; \
+        currval = bit_idx < 32 ? (tempval << bit_idx) : 0; \
+    } \
+    else \
+        currval |= (tempval << bit_idx)
+
+#define JPUT_HUFF(val, table) \
+    code = table[(val) + 2]; \
+    JPUT_BITS(code >> 8, (int)(code & 255))
+
+// entropy-codes a quantized block (the coefficients are in the order of zigzag's indices)
+// of the component c with the luma (table 0) or the chroma (table 1) Huffman tables
+inline void MJpegWriterImpl::writeBlock( const short* block, int c, int table,
+                                         unsigned& currval, int& bit_idx )
+{
+    const unsigned* htable = huff_ac_tab[table];
+    unsigned code = 0, tempval = 0;
+    int j, run = 0, val;
+
+    val = block[0] - dc_pred[c];
+    dc_pred[c] = block[0];
+    
+    {
+        int cat = cat_table[val + CAT_TAB_SIZE];
+        
+        //CV_Assert( cat <= 11 );
+        JPUT_HUFF( cat, huff_dc_tab[table] );
+        JPUT_BITS( val - (val < 0 ? 1 : 0), cat );
+    }
+    
+    for( j = 1; j < 64; j++ )
+    {
+        val = block[zigzag[j]];
+        
+        if( val == 0 )
+        {
+            run++;
+        }
+        else
+        {
+            while( run >= 16 )
+            {
+                JPUT_HUFF( 0xF0, htable ); // encode 16 zeros
+                run -= 16;
+            }
+            
+            {
+                int cat = cat_table[val + CAT_TAB_SIZE];
+                //CV_Assert( cat <= 10 );
+                JPUT_HUFF( cat + run*16, htable );
+                JPUT_BITS( val - (val < 0 ? 1 : 0), cat );
+            }
+            
+            run = 0;
+        }
+    }
+    
+    if( run )
+    {
+        JPUT_HUFF( 0x00, htable ); // encode EOB
+    }
+}
+
+// the weight of the bits against the squared error in RDO quantization, the error is in
+// the squares of the luma DC step of the quality (see rdoWeight)
+static const float RDO_LAMBDA = 0.2f;
+
+void MJpegWriterImpl::rdoQuantizeBlock( const int* coeffs, short* block, int table )
+{
+    const unsigned* htable = huff_ac_tab[table];
+    float zdist[64]; // the error of zeroing the coefficients 1..j (in the zigzag order)
+    float cost[64];  // the least cost of coding 1..j with the coefficient j the last nonzero one
+    int prev[64], level[64], nonzero[64];
+    int j, k, count = 0;
+
+    memset( block, 0, 64*sizeof(block[0]) );
+    block[0] = (short)DCT_DESCALE(coeffs[0], rdofrac);
+
+    // a coefficient is rounded, rounded down by one or zeroed; the trellis keeps
+    // the best choice for each position of the last nonzero coefficient before it
+    zdist[0] = cost[0] = 0.f;
+    nonzero[count++] = 0;
+    for( j = 1; j < 64; j++ )
+    {
+        float a = std::abs(coeffs[zigzag[j]])*(1.f/(1 << rdofrac));
+        int l = (int)(a + 0.5f);
+        float w = rdoWeight[table][j];
+
+        zdist[j] = zdist[j - 1] + a*a*w;
+        if( l == 0 )
+            continue;
+
+        cost[j] = FLT_MAX;
+        for( int lv = l; lv >= std::max(l - 1, 1); lv-- )
+        {
+            int cat = cat_table[lv + CAT_TAB_SIZE];
+            float d = (a - lv)*(a - lv)*w + zdist[j - 1];
+
+            for( k = 0; k < count; k++ )
+            {
+                int p = nonzero[k], run = j - p - 1;
+                int bits = (run >> 4)*(htable[0xF0 + 2] & 255) + (htable[(run & 15)*16 + cat + 2] & 255) + cat;
+                float c = cost[p] - zdist[p] + d + RDO_LAMBDA*bits;
+                if( c < cost[j] )
+                {
+                    cost[j] = c;
+                    prev[j] = p;
+                    level[j] = lv;
+                }
+            }
+        }
+        nonzero[count++] = j;
+    }
+
+    // the coefficients after the last nonzero one are coded by EOB
+    float best = FLT_MAX;
+    int last = 0;
+    for( k = 0; k < count; k++ )
+    {
+        int p = nonzero[k];
+        float c = cost[p] + zdist[63] - zdist[p] + (p < 63 ? RDO_LAMBDA*(htable[0x00 + 2] & 255) : 0.f);
+        if( c < best )
+        {
+            best = c;
+            last = p;
+        }
+    }
+
+    for( j = last; j > 0; j = prev[j] )
+    {
+        int idx = zigzag[j];
+        block[idx] = (short)(coeffs[idx] < 0 ? -level[j] : level[j]);
+    }
+}
+
+void MJpegWriterImpl::writeFrameHeader( const int* sampling )
+{
+    static bool init_cat_table = false;
+    if( !init_cat_table )
+    {
+        for( int i = -CAT_TAB_SIZE; i <= CAT_TAB_SIZE; i++ )
+        {
+            float a = (float)i;
+            cat_table[i+CAT_TAB_SIZE] = (((int&)a >> 23) & 255) - (126 & (i ? -1 : 0));
+        }
+        init_cat_table = true;
+    }
+
+    CV_Assert( width > 0 && height > 0 );
+
+    // encode the header and tables
+    // for each mcu:
+    //   convert rgb to yuv with downsampling (if color).
+    //   for every block:
+    //     calc dct and quantize
+    //     encode block.
+    int i, j;
+
+    int  x_scale = channels > 1 ? 2 : 1, y_scale = x_scale;
+    int  luma_count = x_scale*y_scale;
+
+    if( quality < MIN_QUALITY ) quality = MIN_QUALITY;
+    if( quality > MAX_QUALITY ) quality = MAX_QUALITY;
+
+    // the tables are computed again only when the quality changes
+    if( quality != qtabQuality )
+    {
+        double inv_quality = 1./quality;
+
+        for( i = 0; i < (channels > 1 ? 2 : 1); i++ )
+        {
+            const uchar* qtable = i == 0 ? jpegTableK1_T : jpegTableK2_T;
+            int chroma_scale = i > 0 ? luma_count : 1;
+
+            for( j = 0; j < 64; j++ )
+            {
+                int idx = zigzag[j];
+                int qval = cvRound(qtable[idx]*inv_quality);
+                if( qval < 1 )
+                    qval = 1;
+                if( qval > 255 )
+                    qval = 255;
+                fdct_qtab[i][(idx/8) + (idx%8)*8] = (cvRound((1 << (postshift + 11)))/
+                                            (qval*chroma_scale*idct_prescale[idx]));
+                int64 div = (int64)qval*chroma_scale*idct_prescale[idx];
+                fdct_qtab32[i][(idx/8) + (idx%8)*8] = (int)((((int64)1 << (postshift32 + 11)) + div/2)/div);
+                rdoWeight[i][j] = (float)(qval*quality*qval*quality/(16*16));
+                qtab[i][j] = (uchar)qval;
+            }
+        }
+        qtabQuality = quality;
+    }
+
+    // Encode header
+    if( avi1 )
+        strm.putBytes( (const uchar*)avi1Header, sizeof(avi1Header) - 1 );
+    else
+        strm.putBytes( (const uchar*)jpegHeader, sizeof(jpegHeader) - 1 );
+
+    // Encode quantization tables
+    for( i = 0; i < (channels > 1 ? 2 : 1); i++ )
+    {
+        strm.jputShort( 0xffdb );   // DQT marker
+        strm.jputShort( 2 + 65*1 ); // put single qtable
+        strm.putByte( 0*16 + i );   // 8-bit table
+        strm.putBytes( qtab[i], 64 ); // put coefficients
+    }
+
+    // Encode huffman tables (the ones of 12-bit frames are written with the scan)
+    for( i = 0; precision == 8 && i < (channels > 1 ? 4 : 2); i++ )
+    {
+        const uchar* htable = i == 0 ? jpegTableK3 : i == 1 ? jpegTableK5 :
+        i == 2 ? jpegTableK4 : jpegTableK6;
+        setHuffmanTable( htable, i & 1, i >= 2, !avi1 );
+    }
+
+    // put frame header
+    strm.jputShort( precision == 8 ? 0xFFC0 : 0xFFC1 ); // SOF0 (baseline) or SOF1 (extended) marker
+    strm.jputShort( 8 + 3*channels );  // length of frame header
+    strm.putByte( precision );       // sample precision
+    strm.jputShort( height );
+    strm.jputShort( width );
+    strm.putByte( channels );        // number of components
+
+    for( i = 0; i < channels; i++ )
+    {
+        strm.putByte( i + 1 );  // (i+1)-th component id (Y,U or V)
+        if( sampling )
+            strm.putByte( sampling[i] );
+        else if( i == 0 )
+            strm.putByte(x_scale*16 + y_scale); // chroma scale factors
+        else
+            strm.putByte(1*16 + 1);
+        strm.putByte( i > 0 ); // quantization table idx
+    }
+
+    if( precision == 8 )
+        writeScanHeader();
+}
+
+void MJpegWriterImpl::setHuffmanTable( const uchar* htable, int is_ac_tab, int idx, bool put )
+{
+    int  hbuffer[1024];
+    int  i, tableSize = 16;
+
+    for( i = 0; i < 16; i++ )
+        tableSize += htable[i];
+
+    if( put )
+    {
+        strm.jputShort( 0xFFC4 );      // DHT marker
+        strm.jputShort( 3 + tableSize ); // define one huffman table
+        strm.putByte( is_ac_tab*16 + idx ); // put DC/AC flag and table index
+        strm.putBytes( htable, tableSize ); // put table
+    }
+
+    BitStream::createEncodeHuffmanTable( BitStream::createSourceHuffmanTable(
+                        htable, hbuffer, 16, 9 ), is_ac_tab ? huff_ac_tab[idx] :
+                        huff_dc_tab[idx], is_ac_tab ? 256 + 2 : 16 + 2 );
+}
+
+void MJpegWriterImpl::writeScanHeader()
+{
+    int i;
+
+    // put scan header
+    strm.jputShort( 0xFFDA );          // SOS marker
+    strm.jputShort( 6 + 2*channels );  // length of scan header
+    strm.putByte( channels );          // number of components in the scan
+
+    for( i = 0; i < channels; i++ )
+    {
+        strm.putByte( i+1 );             // component id
+        strm.putByte( (i>0)*16 + (i>0) );// selection of DC & AC tables
+    }
+
+    strm.jputShort(0*256 + 63); // start and end of spectral selection - for
+                                // sequental DCT start is 0 and end is 63
+
+    strm.putByte( 0 );  // successive approximation bit position
+                        // high & low - (0,0) for sequental DCT
+
+    dc_pred[0] = dc_pred[1] = dc_pred[2] = 0;
+    bitValue = 0;
+    bitIdx = 32;
+}
+
+void MJpegWriterImpl::writeMCURows( const uchar* const* planes, int step, int uv_step,
+                                    int height, int input_channels )
+{
+    const uchar* data = planes[0];
+    int x, y;
+    int i, j;
+    int  x_scale = channels > 1 ? 2 : 1, y_scale = x_scale;
+    int  x_step = x_scale * 8;
+    int  y_step = y_scale * 8;
+    short  block[6][64];
+    short  buffer[4096];
+    int  coeffs[64];
+    int  luma_count = x_scale*y_scale;
+    int  block_count = luma_count + channels - 1;
+    int  Y_step = x_scale*8;
+    const int UV_step = 16;
+    int u_plane_ofs = colorspace == COLORSPACE_YUV444P ? (int)(planes[1] - data) : 0;
+    int v_plane_ofs = colorspace == COLORSPACE_YUV444P ? (int)(planes[2] - data) : 0;
+    int uv_cn = colorspace == COLORSPACE_NV12 ? 2 : 1;
+    unsigned currval = bitValue;
+    int bit_idx = bitIdx;
+
+    if( precision > 8 )
+    {
+        writeMCURows12( planes, step, height );
+        return;
+    }
 
     // encode data
     for( y = 0; y < height; y += y_step, data += y_step*step )
@@ -1190,23 +2093,34 @@ void MJpegWriterImpl::writeFrameData( const uchar* data, int step,
                 short* UV_data = block[luma_count];
                 // double t = (double)cv::getTickCount();
 
-                if( colorspace == COLORSPACE_YUV444P && y_limit == 16 && x_limit == 16 )
+                if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+                {
+                    int uv_ofs = (y/2)*uv_step + (x/2)*uv_cn;
+                    loadYUV420( pix_data, step, planes[1] + uv_ofs, planes[2] + uv_ofs, uv_step, uv_cn,
+                                Y_data, UV_data, x_limit, y_limit );
+                }
+                else if( colorspace == COLORSPACE_YUYV || colorspace == COLORSPACE_UYVY )
+                {
+                    loadYUV422( pix_data, step, colorspace == COLORSPACE_UYVY,
+                                Y_data, UV_data, x_limit, y_limit );
+                }
+                else if( colorspace == COLORSPACE_YUV444P && y_limit == 16 && x_limit == 16 )
                 {
                     for( i = 0; i < y_limit; i += 2, pix_data += step*2, Y_data += Y_step*2, UV_data += UV_step )
                     {
 #ifdef WITH_NEON
                         {
                             uint16x8_t masklo = vdupq_n_u16(255);
-                            uint16x8_t lane = vld1q_u16((unsigned short*)(pix_data+v_plane_ofs));
+                            uint16x8_t lane = vld1q_u16((unsigned short*)(pix_data+u_plane_ofs));
                             uint16x8_t t1 = vaddq_u16(vshrq_n_u16(lane, 8), vandq_u16(lane, masklo));
-                            lane = vld1q_u16((unsigned short*)(pix_data + v_plane_ofs + step));
+                            lane = vld1q_u16((unsigned short*)(pix_data + u_plane_ofs + step));
                             uint16x8_t t2 = vaddq_u16(vshrq_n_u16(lane, 8), vandq_u16(lane, masklo));
                             t1 = vaddq_u16(t1, t2);
                             vst1q_s16(UV_data, vsubq_s16(vreinterpretq_s16_u16(t1), vdupq_n_s16(128*4)));
 
-                            lane = vld1q_u16((unsigned short*)(pix_data+u_plane_ofs));
+                            lane = vld1q_u16((unsigned short*)(pix_data+v_plane_ofs));
                             t1 = vaddq_u16(vshrq_n_u16(lane, 8), vandq_u16(lane, masklo));
-                            lane = vld1q_u16((unsigned short*)(pix_data + u_plane_ofs + step));
+                            lane = vld1q_u16((unsigned short*)(pix_data + v_plane_ofs + step));
                             t2 = vaddq_u16(vshrq_n_u16(lane, 8), vandq_u16(lane, masklo));
                             t1 = vaddq_u16(t1, t2);
                             vst1q_s16(UV_data + 8, vsubq_s16(vreinterpretq_s16_u16(t1), vdupq_n_s16(128*4)));
@@ -1241,10 +2155,10 @@ void MJpegWriterImpl::writeFrameData( const uchar* data, int step,
                             Y_data[j+Y_step+1] = pix_data[step+1] - 128;
 
 
-                            UV_data[j>>1] = pix_data[v_plane_ofs] + pix_data[v_plane_ofs+1] +
-                                    pix_data[v_plane_ofs+step] + pix_data[v_plane_ofs+step+1] - 128*4;
-                            UV_data[(j>>1)+8] = pix_data[u_plane_ofs] + pix_data[u_plane_ofs+1] +
+                            UV_data[j>>1] = pix_data[u_plane_ofs] + pix_data[u_plane_ofs+1] +
                                     pix_data[u_plane_ofs+step] + pix_data[u_plane_ofs+step+1] - 128*4;
+                            UV_data[(j>>1)+8] = pix_data[v_plane_ofs] + pix_data[v_plane_ofs+1] +
+                                    pix_data[v_plane_ofs+step] + pix_data[v_plane_ofs+step+1] - 128*4;
 
                         }
 
@@ -1283,8 +2197,8 @@ void MJpegWriterImpl::writeFrameData( const uchar* data, int step,
                             else
                             {
                                 Y = pix_data[0] - 128;
-                                U = pix_data[v_plane_ofs] - 128;
-                                V = pix_data[u_plane_ofs] - 128;
+                                U = pix_data[u_plane_ofs] - 128;
+                                V = pix_data[v_plane_ofs] - 128;
                             }
 
                             int j2 = j >> (x_scale - 1);
@@ -1316,71 +2230,471 @@ void MJpegWriterImpl::writeFrameData( const uchar* data, int step,
             {
                 int is_chroma = i >= luma_count;
                 int src_step = x_scale * 8;
-                int run = 0, val;
                 const short* src_ptr = block[i & -2] + (i & 1)*8;
-                const unsigned* htable = huff_ac_tab[is_chroma];
 
                 //double t = (double)cv::getTickCount();
-                aan_fdct8x8( src_ptr, buffer, src_step, fdct_qtab[is_chroma] );
-                //total_dct += (double)cv::getTickCount() - t;
-
-                j = is_chroma + (i > luma_count);
-                val = buffer[0] - dc_pred[j];
-                dc_pred[j] = buffer[0];
-                
+                if( rdo )
                 {
-                    int cat = cat_table[val + CAT_TAB_SIZE];
-                    
-                    //CV_Assert( cat <= 11 );
-                    JPUT_HUFF( cat, huff_dc_tab[is_chroma] );
-                    JPUT_BITS( val - (val < 0 ? 1 : 0), cat );
+                    aan_fdct8x8_32( src_ptr, coeffs, src_step, fdct_qtab32[is_chroma], postshift32 - rdofrac );
+                    rdoQuantizeBlock( coeffs, buffer, is_chroma );
                 }
-                
-                for( j = 1; j < 64; j++ )
+                else
+                    aan_fdct8x8( src_ptr, buffer, src_step, fdct_qtab[is_chroma] );
+                //total_dct += (double)cv::getTickCount() - t;
+
+                writeBlock( buffer, is_chroma + (i > luma_count), is_chroma, currval, bit_idx );
+            }
+        }
+    }
+    
+    bitValue = currval;
+    bitIdx = bit_idx;
+}
+
+void MJpegWriterImpl::writeMCURows12( const uchar* const* planes, int step, int height )
+{
+    int  x, y, i, j;
+    int  x_scale = channels > 1 ? 2 : 1, y_scale = x_scale;
+    int  x_step = x_scale * 8;
+    int  y_step = y_scale * 8;
+    short  block[6][64];
+    int  coeffs[64];
+    int  luma_count = x_scale*y_scale;
+    int  block_count = luma_count + channels - 1;
+    size_t mcu_count = (size_t)((width + x_step - 1)/x_step)*((height + y_step - 1)/y_step);
+    size_t ofs = frameBlocks.size();
+
+    frameBlocks.resize( ofs + mcu_count*block_count*64 );
+    short* dst = &frameBlocks[ofs];
+
+    for( y = 0; y < height; y += y_step )
+    {
+        for( x = 0; x < width; x += x_step )
+        {
+            int x_limit = std::min(x_step, width - x);
+            int y_limit = std::min(y_step, height - y);
+
+            memset( block, 0, block_count*64*sizeof(block[0][0]));
+
+            // the luma rows span the blocks of the MCU as in writeMCURows, the chroma is the sum
+            // of 2x2 samples (the missing ones at the odd edges of the frame are repeated)
+            for( i = 0; i < y_limit; i++ )
+            {
+                const ushort* Y = (const ushort*)(planes[0] + (size_t)(y + i)*step) + x;
+                short* Y_data = block[0] + i*x_step;
+
+                for( j = 0; j < x_limit; j++ )
+                    Y_data[j] = (short)(Y[j] - 2048);
+
+                if( channels > 1 )
                 {
-                    val = buffer[zigzag[j]];
-                    
-                    if( val == 0 )
+                    const ushort* U = (const ushort*)(planes[1] + (size_t)(y + i)*step) + x;
+                    const ushort* V = (const ushort*)(planes[2] + (size_t)(y + i)*step) + x;
+                    short* UV_data = block[luma_count] + (i >> 1)*16;
+
+                    for( j = 0; j < x_limit; j++ )
                     {
-                        run++;
+                        UV_data[j >> 1] = (short)(UV_data[j >> 1] + U[j] - 2048);
+                        UV_data[(j >> 1) + 8] = (short)(UV_data[(j >> 1) + 8] + V[j] - 2048);
                     }
-                    else
+                    if( x_limit & 1 )
                     {
-                        while( run >= 16 )
-                        {
-                            JPUT_HUFF( 0xF0, htable ); // encode 16 zeros
-                            run -= 16;
-                        }
-                        
-                        {
-                            int cat = cat_table[val + CAT_TAB_SIZE];
-                            //CV_Assert( cat <= 10 );
-                            JPUT_HUFF( cat + run*16, htable );
-                            JPUT_BITS( val - (val < 0 ? 1 : 0), cat );
-                        }
-                        
-                        run = 0;
+                        UV_data[j >> 1] = (short)(UV_data[j >> 1] + U[j - 1] - 2048);
+                        UV_data[(j >> 1) + 8] = (short)(UV_data[(j >> 1) + 8] + V[j - 1] - 2048);
                     }
+                    if( (y_limit & 1) && i == y_limit - 1 )
+                        for( j = 0; j < 16; j++ )
+                            UV_data[j] = (short)(UV_data[j]*2);
                 }
-                
-                if( run )
-                {
-                    JPUT_HUFF( 0x00, htable ); // encode EOB
-                }
+            }
+
+            for( i = 0; i < block_count; i++, dst += 64 )
+            {
+                int is_chroma = i >= luma_count;
+                aan_fdct8x8_32( block[i & -2] + (i & 1)*8, coeffs, x_step, fdct_qtab32[is_chroma], postshift32 );
+                for( j = 0; j < 64; j++ )
+                    dst[j] = (short)coeffs[j];
             }
         }
     }
-    
+}
+
+// counts the symbols of a quantized block as writeBlock codes them
+static void countBlockSymbols( const short* block, int& dc_pred, int* dc_freq, int* ac_freq )
+{
+    int j, run = 0, val;
+
+    val = block[0] - dc_pred;
+    dc_pred = block[0];
+    dc_freq[cat_table[val + CAT_TAB_SIZE]]++;
+
+    for( j = 1; j < 64; j++ )
+    {
+        val = block[zigzag[j]];
+        if( val == 0 )
+            run++;
+        else
+        {
+            for( ; run >= 16; run -= 16 )
+                ac_freq[0xF0]++;
+            ac_freq[cat_table[val + CAT_TAB_SIZE] + run*16]++;
+            run = 0;
+        }
+    }
+
+    if( run )
+        ac_freq[0x00]++;
+}
+
+// builds the Huffman table (the counts of the codes by length, then the symbols) of the symbols
+// 0..255 by their frequencies with the code length limited to 16 bits (the procedure of Annex K.2)
+static void createOptimalHuffmanTable( const int* src_freq, uchar* htable )
+{
+    int  freq[257], codesize[257], others[257], bits[258];
+    int  i, j, k;
+
+    for( i = 0; i < 256; i++ )
+        freq[i] = src_freq[i];
+    freq[256] = 1; // reserves the code of all ones, which is not used
+    for( i = 0; i < 257; i++ )
+    {
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    for( ;; )
+    {
+        // merge the two least frequent trees (the greater symbol of the equal ones goes first)
+        int c1 = -1, c2 = -1;
+        for( i = 0; i < 257; i++ )
+            if( freq[i] > 0 && (c1 < 0 || freq[i] <= freq[c1]) )
+                c1 = i;
+        for( i = 0; i < 257; i++ )
+            if( freq[i] > 0 && i != c1 && (c2 < 0 || freq[i] <= freq[c2]) )
+                c2 = i;
+        if( c2 < 0 )
+            break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codesize[c1]++;
+        while( others[c1] >= 0 )
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while( others[c2] >= 0 )
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    memset( bits, 0, sizeof(bits) );
+    for( i = 0; i < 257; i++ )
+        if( codesize[i] > 0 )
+            bits[codesize[i]]++;
+
+    // the longer codes are moved up the tree by pairs
+    for( i = 257; i > 16; i-- )
+    {
+        while( bits[i] > 0 )
+        {
+            for( j = i - 2; bits[j] == 0; j-- )
+                ;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    for( ; bits[i] == 0; i-- )
+        ;
+    bits[i]--; // the reserved code
+
+    for( i = 1; i <= 16; i++ )
+        htable[i - 1] = (uchar)bits[i];
+    for( i = 1, k = 16; i <= 257; i++ )
+        for( j = 0; j < 256; j++ )
+            if( codesize[j] == i )
+                htable[k++] = (uchar)j;
+}
+
+void MJpegWriterImpl::writeOptimizedScan()
+{
+    int  x_scale = channels > 1 ? 2 : 1;
+    int  luma_count = x_scale*x_scale;
+    int  block_count = luma_count + channels - 1;
+    int  dc_freq[2][256], ac_freq[2][256];
+    uchar htable[16 + 256];
+    size_t i, count = frameBlocks.size()/64;
+    const short* blocks = count > 0 ? &frameBlocks[0] : 0;
+    int  k;
+
+    memset( dc_freq, 0, sizeof(dc_freq) );
+    memset( ac_freq, 0, sizeof(ac_freq) );
+    dc_pred[0] = dc_pred[1] = dc_pred[2] = 0;
+
+    for( i = 0; i < count; i++ )
+    {
+        int b = (int)(i % block_count), is_chroma = b >= luma_count;
+        countBlockSymbols( blocks + i*64, dc_pred[is_chroma + (b > luma_count)],
+                           dc_freq[is_chroma], ac_freq[is_chroma] );
+    }
+
+    for( k = 0; k < (channels > 1 ? 4 : 2); k++ )
+    {
+        int is_ac_tab = k & 1, idx = k >= 2;
+        int* freq = is_ac_tab ? ac_freq[idx] : dc_freq[idx];
+        // the encoding tables are indexed from the symbol 0, so it is always there
+        freq[0] = std::max(freq[0], 1);
+        createOptimalHuffmanTable( freq, htable );
+        setHuffmanTable( htable, is_ac_tab, idx, true );
+    }
+
+    writeScanHeader();
+
+    unsigned currval = bitValue;
+    int bit_idx = bitIdx;
+
+    for( i = 0; i < count; i++ )
+    {
+        int b = (int)(i % block_count), is_chroma = b >= luma_count;
+        writeBlock( blocks + i*64, is_chroma + (b > luma_count), is_chroma, currval, bit_idx );
+    }
+
+    bitValue = currval;
+    bitIdx = bit_idx;
+}
+
+void MJpegWriterImpl::writeFrameEnd()
+{
+    if( precision > 8 )
+        writeOptimizedScan();
+
+    unsigned currval = bitValue, tempval = 0;
+    int bit_idx = bitIdx;
+
     // Flush
     JPUT_BITS((unsigned)-1, bit_idx & 31);
     strm.jputShort( 0xFFD9 ); // EOI marker
     /*printf("total dct = %.1fms, total cvt = %.1fms\n",
            total_dct*1000./cv::getTickFrequency(),
            total_cvt*1000./cv::getTickFrequency());*/
-    size_t pos = strm.getPos();
-    size_t pos1 = (pos + 3) & ~3;
-    for( ; pos < pos1; pos++ )
-        strm.putByte(0);
+    padFrame();
+}
+
+bool MJpegWriterImpl::writeCoefficients( const jpeg::JpegCoefficients& src )
+{
+    CV_Assert( !inFrame && precision == 8 );
+    if( src.width != width || src.height != height || src.ncomponents != channels )
+        return false;
+
+    int c, i, k, x, y;
+    int sampling[3];
+    int64 scale[3][64]; // the source quantization step / the new one, 16-bit fixed point
+    ushort scale16[3][64];
+    bool small_scale[3]; // all the steps of the component get larger, so the scale is 16-bit
+    short block[64];
+    unsigned currval;
+    int bit_idx;
+
+    chunkPointer = strm.getPos();
+    lastHashValid = false;
+    if( !rawstream )
+        startWriteChunk(fourCC('0', '0', 'd', 'c'));
+
+    // a single component is coded by blocks, not by MCUs
+    for( c = 0; c < channels; c++ )
+        sampling[c] = channels > 1 ? src.h[c]*16 + src.v[c] : 1*16 + 1;
+    writeFrameHeader( sampling );
+
+    for( c = 0; c < channels; c++ )
+    {
+        small_scale[c] = true;
+        for( k = 0; k < 64; k++ )
+        {
+            int idx = zigzag[k];
+            scale[c][idx] = ((int64)src.qtab[c][idx]*65536*2 + qtab[c > 0][k])/(qtab[c > 0][k]*2);
+            scale16[c][idx] = (ushort)scale[c][idx];
+            small_scale[c] = small_scale[c] && scale[c][idx] < 65536;
+        }
+    }
+
+    currval = bitValue;
+    bit_idx = bitIdx;
+
+    int mcu_w = channels > 1 ? src.h[0] : 1, mcu_h = channels > 1 ? src.v[0] : 1;
+    int mcu_cols = (width + mcu_w*8 - 1)/(mcu_w*8), mcu_rows = (height + mcu_h*8 - 1)/(mcu_h*8);
+
+    for( int my = 0; my < mcu_rows; my++ )
+        for( int mx = 0; mx < mcu_cols; mx++ )
+            for( c = 0; c < channels; c++ )
+            {
+                int h = channels > 1 ? src.h[c] : 1, v = channels > 1 ? src.v[c] : 1;
+                for( y = 0; y < v; y++ )
+                    for( x = 0; x < h; x++ )
+                    {
+                        const short* src_block = src.blocks[c] +
+                            ((size_t)(my*v + y)*src.blocks_per_row[c] + mx*h + x)*64;
+
+                        // rounded to the nearest step, in the range of the baseline Huffman codes
+                        i = 0;
+#if defined WITH_SSE2
+                        if( small_scale[c] )
+                            for( ; i < 64; i += 8 )
+                            {
+                                __m128i v = _mm_loadu_si128((const __m128i*)(src_block + i));
+                                __m128i sign = _mm_srai_epi16(v, 15);
+                                __m128i a = _mm_sub_epi16(_mm_xor_si128(v, sign), sign);
+                                __m128i sc = _mm_loadu_si128((const __m128i*)(scale16[c] + i));
+                                // the high half of the product, rounded by the high bit of the low half
+                                __m128i q = _mm_add_epi16(_mm_mulhi_epu16(a, sc),
+                                                          _mm_srli_epi16(_mm_mullo_epi16(a, sc), 15));
+                                q = _mm_min_epi16(q, _mm_set1_epi16(1023));
+                                _mm_storeu_si128((__m128i*)(block + i), _mm_sub_epi16(_mm_xor_si128(q, sign), sign));
+                            }
+#elif defined WITH_NEON
+                        if( small_scale[c] )
+                            for( ; i < 64; i += 8 )
+                            {
+                                int16x8_t v = vld1q_s16(src_block + i);
+                                uint16x8_t a = vreinterpretq_u16_s16(vabsq_s16(v));
+                                uint16x8_t sc = vld1q_u16(scale16[c] + i);
+                                uint16x8_t q = vcombine_u16(vrshrn_n_u32(vmull_u16(vget_low_u16(a), vget_low_u16(sc)), 16),
+                                                            vrshrn_n_u32(vmull_u16(vget_high_u16(a), vget_high_u16(sc)), 16));
+                                int16x8_t r = vreinterpretq_s16_u16(vminq_u16(q, vdupq_n_u16(1023)));
+                                vst1q_s16(block + i, vbslq_s16(vcltq_s16(v, vdupq_n_s16(0)), vnegq_s16(r), r));
+                            }
+#endif
+                        for( ; i < 64; i++ )
+                        {
+                            int val = src_block[i];
+                            if( val != 0 )
+                            {
+                                val = (int)std::min((std::abs(val)*scale[c][i] + 32768) >> 16, (int64)1023);
+                                val = src_block[i] < 0 ? -val : val;
+                            }
+                            block[i] = (short)val;
+                        }
+                        writeBlock( block, c, c > 0, currval, bit_idx );
+                    }
+            }
+
+    bitValue = currval;
+    bitIdx = bit_idx;
+    writeFrameEnd();
+    addFrame();
+    return true;
+}
+
+// the multiplier of the mixing of the words in hashFrame
+static const unsigned HASH_MUL = 0x45d9f3b;
+
+// a bijective non-linear mix of a word, so the changes of the pixels do not cancel out in the sums
+static inline unsigned hashMix(unsigned w)
+{
+    w = (w ^ (w >> 16))*HASH_MUL;
+    return w ^ (w >> 16);
+}
+
+// Fletcher-like sums of the mixed 32-bit words of the rows in 4 lanes; the rows are summed by 16 bytes
+// (the tail padded with zeros), so SIMD and scalar code give the same hash
+uint64 MJpegWriterImpl::hashFrame(const Mat& img) const
+{
+    unsigned s1[4] = { 0, 0, 0, 0 }, s2[4] = { 0, 0, 0, 0 };
+    int row_size = img.cols*(int)img.elemSize();
+
+    for( int y = 0; y < img.rows; y += dupStep )
+    {
+        const uchar* row = img.ptr(y);
+        int i = 0, k;
+#if defined WITH_SSE2
+        __m128i a = _mm_loadu_si128((const __m128i*)s1), b = _mm_loadu_si128((const __m128i*)s2);
+        __m128i mul = _mm_set1_epi32((int)HASH_MUL);
+        for( ; i + 16 <= row_size; i += 16 )
+        {
+            __m128i w = _mm_loadu_si128((const __m128i*)(row + i));
+            w = _mm_xor_si128(w, _mm_srli_epi32(w, 16));
+            // the low halves of the 32-bit products of the even and the odd lanes
+            __m128i even = _mm_mul_epu32(w, mul), odd = _mm_mul_epu32(_mm_srli_epi64(w, 32), mul);
+            w = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                   _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+            w = _mm_xor_si128(w, _mm_srli_epi32(w, 16));
+            a = _mm_add_epi32(a, w);
+            b = _mm_add_epi32(b, a);
+        }
+        _mm_storeu_si128((__m128i*)s1, a);
+        _mm_storeu_si128((__m128i*)s2, b);
+#elif defined WITH_NEON
+        uint32x4_t a = vld1q_u32(s1), b = vld1q_u32(s2);
+        uint32x4_t mul = vdupq_n_u32(HASH_MUL);
+        for( ; i + 16 <= row_size; i += 16 )
+        {
+            uint32x4_t w = vreinterpretq_u32_u8(vld1q_u8(row + i));
+            w = vmulq_u32(veorq_u32(w, vshrq_n_u32(w, 16)), mul);
+            w = veorq_u32(w, vshrq_n_u32(w, 16));
+            a = vaddq_u32(a, w);
+            b = vaddq_u32(b, a);
+        }
+        vst1q_u32(s1, a);
+        vst1q_u32(s2, b);
+#endif
+        for( ; i < row_size; i += 16 )
+        {
+            unsigned w[4] = { 0, 0, 0, 0 };
+            memcpy( w, row + i, std::min(row_size - i, 16) );
+            for( k = 0; k < 4; k++ )
+            {
+                s1[k] += hashMix(w[k]);
+                s2[k] += s1[k];
+            }
+        }
+    }
+
+    uint64 hash = (uint64)14695981039346656037ULL;
+    for( int k = 0; k < 4; k++ )
+    {
+        hash = (hash ^ s1[k])*1099511628211ULL;
+        hash = (hash ^ s2[k])*1099511628211ULL;
+    }
+    return hash;
+}
+
+bool transcodeMJpeg(const std::string& src_filename, const std::string& dst_filename, int quality)
+{
+    CV_Assert( 1 <= quality && quality <= 100 );
+    Ptr<MJpegReader> reader = openMJpegReader(src_filename, Size(), 30, MJpegReader::COLORSPACE_BGR);
+    if( !reader || !reader->isOpened() )
+        return false;
+
+    Ptr<jpeg::JpegDecoder> decoder = jpeg::createJpegDecoder();
+    jpeg::JpegCoefficients coeffs;
+    MJpegWriterImpl writer;
+    const uchar* data;
+    size_t size;
+
+    while( reader->grab(data, size) )
+    {
+        if( !decoder->decodeCoefficients(data, size, coeffs) )
+            return false;
+        if( !writer.isOpened() )
+        {
+            if( !writer.open(dst_filename, Size(coeffs.width, coeffs.height), reader->getFps(),
+                             coeffs.ncomponents > 1 ? MJpegWriter::COLORSPACE_BGR : MJpegWriter::COLORSPACE_GRAY) )
+                return false;
+            // the tables of libjpeg are scaled by 50/quality below 50 and by 2 - quality/50 above
+            writer.setQuality(quality < 50 ? quality/50. : 100./std::max(200 - quality*2, 1));
+        }
+        if( !writer.writeCoefficients(coeffs) )
+            return false;
+    }
+    return writer.isOpened();
 }
 
 Ptr<MJpegWriter> openMJpegWriter(const std::string& filename, Size size, double fps, int colorspace)
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "opencv2/core/core.hpp"
 #include <string>
 
@@ -9,20 +11,119 @@ namespace mjpeg
 class MJpegWriter
 {
 public:
-    enum { COLORSPACE_GRAY=0, COLORSPACE_RGBA=1, COLORSPACE_BGR=2, COLORSPACE_YUV444P=3 };
+    // YUV444P is 3 full-size planes (Y, U, V) stacked vertically (a height*3 x width 8-bit Mat); NV12 and
+    // I420 are 4:2:0 layouts as the decoder outputs them (a height*3/2 x width 8-bit Mat, the size rounded
+    // up to even numbers), YUV420P is the same as I420: the Y plane followed by quarter-size U and V;
+    // YUYV and UYVY are packed 4:2:2 (a height x width 2-channel Mat, the width is even)
+    enum { COLORSPACE_GRAY=0, COLORSPACE_RGBA=1, COLORSPACE_BGR=2, COLORSPACE_YUV444P=3,
+           COLORSPACE_NV12=4, COLORSPACE_I420=5, COLORSPACE_YUYV=6, COLORSPACE_UYVY=7,
+           COLORSPACE_YUV420P=COLORSPACE_I420 };
     virtual ~MJpegWriter();
     virtual bool write(const Mat& img) = 0;
     virtual bool isOpened() const = 0;
+
+    // writes a frame by strips of rows, e.g. as they come from the camera: beginFrame(), then writeRows()
+    // for each strip, then endFrame(). The strips are of the same format as the image passed to write()
+    // (the planes of YUV444P, NV12 and I420 strips have their rows only; 4:2:0 strips have even number
+    // of rows). The rows are encoded as soon as they complete an MCU row (16 rows, 8 for gray),
+    // only the rest of them is copied
+    virtual bool beginFrame() = 0;
+    virtual bool writeRows(const Mat& rows) = 0;
+    virtual bool endFrame() = 0;
+
+    // rate control: the quality is adjusted between the frames to keep the bitrate (in bits per second,
+    // 0 to encode at fixed quality) on average. If max_frame_size is not 0, a frame passed to write()
+    // that is encoded larger is encoded again at lower quality (frames written by strips are not)
+    virtual void setRateControl(double bitrate, size_t max_frame_size=0) = 0;
+
+    // a frame passed to write() that is the same as the previous one (compared by a hash of its pixels,
+    // of every sample_step-th row) is not encoded if mode is not DUPLICATES_ENCODE: the index refers to
+    // the chunk of the previous frame (DUPLICATES_REUSE, the frames are lost if the file is read without
+    // the index) or to an empty chunk (DUPLICATES_EMPTY). Frames written by strips are always encoded
+    enum { DUPLICATES_ENCODE=0, DUPLICATES_REUSE=1, DUPLICATES_EMPTY=2 };
+    virtual void setDuplicateFrames(int mode, int sample_step=1) = 0;
+
+    // AVI1 format of the frames: they have the AVI1 APP0 marker instead of JFIF and no Huffman tables,
+    // the standard ones that MJPEG decoders assume are used. It saves about 430 bytes per frame
+    virtual void setAVI1(bool avi1) = 0;
+
+    // sample precision of the frames, 8 or 12 bits. 12-bit frames (SOF1, extended sequential) are encoded
+    // from CV_16U images of GRAY or YUV444P colorspace with the samples in 0..4095. They have the same
+    // quantization tables as 8-bit ones at the same quality (so 16 times finer steps of the samples)
+    // and the Huffman tables optimized for each frame, setAVI1 does not apply to them
+    virtual void setPrecision(int bits) = 0;
+
+    // rate-distortion optimized quantization of 8-bit frames encoded from pixels: the AC coefficients
+    // of each block are rounded, rounded down or zeroed by the choice that costs the least bits
+    // for its error under the Huffman tables of the frame. The frames are about 10-15% smaller
+    // at the same PSNR (and of lower PSNR at the same quality), the encoding is about 3 times slower
+    virtual void setRDOQuantization(bool rdo) = 0;
+
+    // appends a JPEG image (e.g. a frame from a camera delivering JPEG) as a frame without decoding it.
+    // Returns false if the data does not start with SOI or the size in its SOF is not the size of the stream
+    virtual bool writeCompressed(const uchar* jpeg, size_t len) = 0;
 };
 
 Ptr<MJpegWriter> openMJpegWriter(const std::string& filename, Size size, double fps, int colorspace);
 
+// writes the frames of an MJPEG AVI file into a new one at the given quality (1..100, as of libjpeg)
+// without decoding them to pixels: the DCT coefficients are requantized and entropy-coded again,
+// the chroma sampling of the frames is kept. Returns false if the file can not be read or written
+// or a frame can not be decoded
+bool transcodeMJpeg(const std::string& src_filename, const std::string& dst_filename, int quality);
+
 }
 
 namespace jpeg
 {
+// output formats of the decoder. GRAY, BGR and YUV444P match MJpegWriter's colorspaces;
+// YUV444P is stored as 3 full-size planes stacked vertically (a height*3 x width 8-bit Mat),
+// NV12 and I420 are 4:2:0 layouts (a height*3/2 x width 8-bit Mat, the size rounded up to even numbers)
+enum { COLORSPACE_GRAY=0, COLORSPACE_BGR=2, COLORSPACE_YUV444P=3,
+       COLORSPACE_NV12=4, COLORSPACE_I420=5, COLORSPACE_BGRA=6 };
+
 void writeJpeg(const std::string& filename, const Mat& img);
-Mat readJpeg(const std::string& filename);
+// scale is 1, 2, 4 or 8: the image is decoded at 1/scale of its size (rounded up).
+// If roi is not empty, only the part of the image covering it is decoded
+Mat readJpeg(const std::string& filename, int colorspace=COLORSPACE_BGR, int scale=1, Rect roi=Rect());
+
+// decodes an image from memory (e.g. a frame of a mapped AVI file) into dst, reallocating it
+// if needed; the parameters are as for readJpeg. Returns false if the data can not be decoded
+bool decodeJpeg(const uchar* data, size_t len, Mat& dst, int colorspace=COLORSPACE_BGR,
+                int scale=1, Rect roi=Rect());
+
+// the quantized DCT coefficients of an image as they are stored in the JPEG data (see decodeCoefficients)
+struct JpegCoefficients
+{
+    int width, height;
+    int ncomponents;            // 1 (gray) or 3 (YCbCr)
+    int h[3], v[3];             // the sampling factors of the components
+    // the blocks of 64 coefficients of each component in raster order, including the ones padding
+    // the MCUs: blocks_per_row[c] = (MCUs per row)*h[c]. The coefficient of the horizontal frequency u
+    // and the vertical one v is at u*8 + v
+    const short* blocks[3];
+    int blocks_per_row[3];
+    ushort qtab[3][64];         // the quantization table of each component, in the order of the blocks
+};
+
+// decoder for a sequence of images (e.g. MJPEG frames). It keeps its buffers and the Huffman and
+// quantization tables between the calls, the tables are rebuilt only when they change.
+// Once the buffers are allocated, decoding of the frames of the same format does not allocate memory
+class JpegDecoder
+{
+public:
+    virtual ~JpegDecoder() {}
+    // the data is read in place if it ends with EOI. dst is used as is if it has the size and
+    // the type of the output (so it may be preallocated by the caller), otherwise it is reallocated
+    virtual bool decode(const uchar* data, size_t len, Mat& dst, int colorspace=COLORSPACE_BGR,
+                        int scale=1, Rect roi=Rect()) = 0;
+    // decode the restart intervals of an image on several threads (if the image has them)
+    virtual void setParallel(bool parallel) = 0;
+    // entropy-decodes the coefficients of an image without the IDCT; they are valid until the next call
+    virtual bool decodeCoefficients(const uchar* data, size_t len, JpegCoefficients& coeffs) = 0;
+};
+
+Ptr<JpegDecoder> createJpegDecoder();
 }
 
 }
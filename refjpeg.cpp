@@ -2,10 +2,21 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
-#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include "mjpegwriter.hpp"
+
+//uncomment for real stuff
+//#define WITH_NEON
+#ifdef WITH_NEON
+#include "arm_neon.h"
+#elif defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define WITH_SSE2
+#include <emmintrin.h>
+#endif
 
 #if _MSC_VER >= 1200
     #pragma warning( disable: 4711 4324 )
@@ -16,8 +27,6 @@ namespace cv
 namespace jpeg
 {
 
-#define  RBS_THROW_EOS    -123  /* <end of stream> exception code */
-#define  RBS_THROW_FORB   -124  /* <forrbidden huffman code> exception code */
 #define  RBS_HUFF_FORB    2047  /* forrbidden huffman code "value" */
 
 typedef unsigned char uchar;
@@ -175,6 +184,13 @@ static const char jpegHeader[] =
 #define C1_847     fix( 1.847759065f, fixb )
 #define C2_613     fix( 2.613125930f, fixb )
 
+// weights of the reduced (downscaling) IDCTs
+#define C0_354     fix( 0.353553391f, fixb )
+#define C0_327     fix( 0.326640741f, fixb )
+#define C0_250     fix( 0.250000000f, fixb )
+#define C0_231     fix( 0.230969883f, fixb )
+#define C0_135     fix( 0.135299025f, fixb )
+
 #define postshift 14
 
 #define fixc       12
@@ -196,106 +212,6 @@ static const char jpegHeader[] =
 #define cr_b      -fix( 0.0813, fixc )
 
 
-// class RBaseStream - base class for other reading streams.
-class RBaseStream
-{
-public:
-    //methods
-    RBaseStream();
-    virtual ~RBaseStream();
-    
-    virtual bool  Open( const char* filename );
-    virtual void  Close();
-    void          SetBlockSize( int block_size, int unGetsize = 4 );
-    bool          IsOpened();
-    void          SetPos( int pos );
-    int           GetPos();
-    void          Skip( int bytes );
-    jmp_buf&      JmpBuf();
-    
-protected:
-    
-    jmp_buf m_jmp_buf;
-    uchar*  m_start;
-    uchar*  m_end;
-    uchar*  m_current;
-    FILE*   m_file;
-    int     m_unGetsize;
-    int     m_block_size;
-    int     m_block_pos;
-    bool    m_jmp_set;
-    bool    m_is_opened;
-
-    virtual void  ReadBlock();
-    virtual void  Release();
-    virtual void  Allocate();
-};
-
-
-// class RLByteStream - uchar-oriented stream.
-// l in prefix means that the least significant uchar of a multi-uchar value goes first
-class RLByteStream : public RBaseStream
-{
-public:
-    virtual ~RLByteStream();
-    
-    int     GetByte();
-    void    GetBytes( void* buffer, int count, int* readed = 0 );
-    int     GetWord();
-    int     GetDWord(); 
-};
-
-// class RMBitStream - uchar-oriented stream.
-// m in prefix means that the most significant uchar of a multi-uchar value go first
-class RMByteStream : public RLByteStream
-{
-public:
-    virtual ~RMByteStream();
-
-    int     GetWord();
-    int     GetDWord(); 
-};
-
-// class RLBitStream - bit-oriented stream.
-// l in prefix means that the least significant bit of a multi-bit value goes first
-class RLBitStream : public RBaseStream
-{
-public:
-    virtual ~RLBitStream();
-    
-    void    SetPos( int pos );
-    int     GetPos();
-    int     Get( int bits );
-    int     Show( int bits );
-    int     GetHuff( const short* table );
-    void    Move( int shift );
-    void    Skip( int bytes );
-        
-protected:
-    int     m_bit_idx;
-    virtual void  ReadBlock();
-};
-
-// class RMBitStream - bit-oriented stream.
-// m in prefix means that the most significant bit of a multi-bit value goes first
-class RMBitStream : public RLBitStream
-{
-public:
-    virtual ~RMBitStream();
-    
-    void    SetPos( int pos );
-    int     GetPos();
-    int     Get( int bits );
-    int     Show( int bits );
-    int     GetHuff( const short* table );
-    void    Move( int shift );
-    void    Skip( int bytes );
-
-protected:
-    virtual void  ReadBlock();
-};
-
-
 #define  BS_DEF_BLOCK_SIZE   (1<<10)
 
 // WBaseStream - base class for output streams
@@ -405,6 +321,8 @@ protected:
 int* bsCreateSourceHuffmanTable( const uchar* src, int* dst, 
                                  int max_bits, int first_bits );
 bool bsCreateDecodeHuffmanTable( const int* src, short* dst, int max_size );
+bool bsCheckHuffmanTable( const uchar* src, int max_bits );
+void bsCreateFastHuffmanTable( const uchar* src, int* dst, int max_bits, int fast_bits );
 bool bsCreateEncodeHuffmanTable( const int* src, unsigned* dst, int max_size );
 
 void bsBSwapBlock( uchar *start, uchar *end );
@@ -442,89 +360,258 @@ bool  bsIsBigEndian( void )
     return (((const int*)"\0\x1\x2\x3\x4\x5\x6\x7")[0] & 255) != 0;
 }
 
-/////////////////////////  RBaseStream ////////////////////////////
+static const int huff_val_shift = 20, huff_code_mask = (1 << huff_val_shift) - 1;
 
-bool  RBaseStream::IsOpened()
-{ 
-    return m_is_opened;
+bool bsCreateDecodeHuffmanTable( const int* src, short* table, int max_size )
+{   
+    const int forbidden_entry = (RBS_HUFF_FORB << 4)|1;
+    int       first_bits = src[0];
+    struct
+    {
+        int bits;
+        int offset;
+    }
+    sub_tables[1 << 11];
+    int  size = (1 << first_bits) + 1;
+    int  i, k;
+    
+    /* calc bit depths of sub tables */
+    memset( sub_tables, 0, ((size_t)1 << first_bits)*sizeof(sub_tables[0]) );
+    for( i = 1, k = 1; src[k] >= 0; i++ )
+    {
+        int code_count = src[k++];
+        int sb = i - first_bits;
+        
+        if( sb <= 0 )
+            k += code_count;
+        else
+            for( code_count += k; k < code_count; k++ )
+            {
+                int  code = src[k] & huff_code_mask;
+                sub_tables[code >> sb].bits = sb;
+            }
+    }
+
+    /* calc offsets of sub tables and whole size of table */
+    for( i = 0; i < (1 << first_bits); i++ )
+    {
+        int b = sub_tables[i].bits;
+        if( b > 0 )
+        {
+            b = 1 << b;
+            sub_tables[i].offset = size;
+            size += b + 1;
+        }
+    }
+
+    if( size > max_size )
+    {
+        assert(0);
+        return false;
+    }
+
+    /* fill first table and subtables with forbidden values */
+    for( i = 0; i < size; i++ )
+    {
+        table[i] = (short)forbidden_entry;
+    }
+
+    /* write header of first table */
+    table[0] = (short)first_bits;
+
+    /* fill first table and sub tables */ 
+    for( i = 1, k = 1; src[k] >= 0; i++ )
+    {
+        int code_count = src[k++];
+        for( code_count += k; k < code_count; k++ )
+        {
+            int  table_bits= first_bits;
+            int  code_bits = i;
+            int  code = src[k] & huff_code_mask;
+            int  val  = src[k] >>huff_val_shift;
+            int  j, offset = 0;
+
+            if( code_bits > table_bits )
+            {
+                int idx = code >> (code_bits -= table_bits);
+                code &= (1 << code_bits) - 1;
+                offset   = sub_tables[idx].offset;
+                table_bits= sub_tables[idx].bits;
+                /* write header of subtable */
+                table[offset]  = (short)table_bits;
+                /* write jump to subtable */
+                table[idx + 1]= (short)(offset << 4);
+            }
+        
+            table_bits -= code_bits;
+            assert( table_bits >= 0 );
+            val = (val << 4) | code_bits;
+            offset += (code << table_bits) + 1;
+        
+            for( j = 0; j < (1 << table_bits); j++ )
+            {
+                assert( table[offset + j] == forbidden_entry );
+                table[ offset + j ] = (short)val;
+            }
+        }
+    }
+    return true;
 }
 
-void  RBaseStream::Allocate()
+
+/* Checks that the numbers of codes of each length of the JPEG table src fit in the lengths,
+   the code of all ones excluded (as libjpeg does). The tables are built of valid ones only */
+bool  bsCheckHuffmanTable( const uchar* src, int max_bits )
 {
-    if( !m_start )
+    int  i, code = 0;
+
+    for( i = 1; i <= max_bits; i++, code <<= 1 )
     {
-        m_start = new uchar[m_block_size + m_unGetsize];
-        m_start+= m_unGetsize;
+        code += src[i - 1];
+        if( code >= (1 << i) )
+            return false;
     }
-    m_end = m_start + m_block_size;
-    m_current = m_end;
+    return true;
+}
+
+
+/* Creates the single lookup table for the codes not longer than fast_bits.
+   src is the JPEG table: the numbers of codes of each length, then the symbols.
+   An entry for the next fast_bits of the stream is 0 if the code is longer, otherwise
+   bits 0..4 hold the number of the bits to skip, bits 8..15 - the symbol (JPEG run/size),
+   and if bit 5 is set, the magnitude bits are skipped too and bits 16..31 hold the
+   sign-extended value */
+void  bsCreateFastHuffmanTable( const uchar* src, int* dst, int max_bits, int fast_bits )
+{
+    int  i, k, val_idx = max_bits, code = 0;
+
+    memset( dst, 0, ((size_t)1 << fast_bits)*sizeof(dst[0]) );
+
+    for( i = 1; i <= max_bits; i++, code <<= 1 )
+    {
+        int code_count = src[i - 1];
+        for( k = 0; k < code_count; k++, code++ )
+        {
+            int  sym = src[val_idx++];
+            int  rest = fast_bits - i, size = sym & 15;
+            int  j;
+
+            if( rest < 0 )
+                continue;
+
+            for( j = 0; j < (1 << rest); j++ )
+            {
+                int entry = (sym << 8) | i;
+                if( size != 0 && size <= rest )
+                {
+                    int val = (j >> (rest - size)) & bs_bit_mask[size];
+                    val -= (val*2 <= (int)bs_bit_mask[size] ? bs_bit_mask[size] : 0);
+                    entry = (int)((unsigned)val << 16) | (sym << 8) | 32 | (i + size);
+                }
+                dst[(code << rest) | j] = entry;
+            }
+        }
+    }
+}
+
+
+int*  bsCreateSourceHuffmanTable( const uchar* src, int* dst,
+                                  int max_bits, int first_bits )
+{
+    int   i, val_idx, code = 0;
+    int*  table = dst;
+    *dst++ = first_bits;
+    for( i = 1, val_idx = max_bits; i <= max_bits; i++ )
+    {
+        int code_count = src[i - 1];
+        dst[0] = code_count;
+        code <<= 1;
+        for( int k = 0; k < code_count; k++ )
+        {
+            dst[k + 1] = (src[val_idx + k] << huff_val_shift)|(code + k);
+        }
+        code += code_count;
+        dst += code_count + 1;
+        val_idx += code_count;
+    }
+    dst[0] = -1;
+    return  table;
 }
 
 
-RBaseStream::RBaseStream()
+/////////////////////////// WBaseStream /////////////////////////////////
+
+// WBaseStream - base class for output streams
+WBaseStream::WBaseStream()
 {
     m_start = m_end = m_current = 0;
     m_file = 0;
     m_block_size = BS_DEF_BLOCK_SIZE;
-    m_unGetsize = 4; // 32 bits
     m_is_opened = false;
-    m_jmp_set = false;
 }
 
 
-RBaseStream::~RBaseStream()
+WBaseStream::~WBaseStream()
 {
     Close();    // Close files
     Release();  // free  buffers
 }
 
 
-void  RBaseStream::ReadBlock()
+bool  WBaseStream::IsOpened()
+{ 
+    return m_is_opened;
+}
+
+
+void  WBaseStream::Allocate()
 {
-    size_t readed;
-    assert( m_file != 0 );
+    if( !m_start )
+        m_start = &m_buf[0];
 
-    // copy unget buffer
-    if( m_start )
-    {
-        memcpy( m_start - m_unGetsize, m_end - m_unGetsize, m_unGetsize );
-    }
+    m_end = m_start + m_block_size;
+    m_current = m_start;
+}
 
-    SetPos( GetPos() ); // normalize position
 
-    fseek( m_file, m_block_pos, SEEK_SET );
-    readed = fread( m_start, 1, m_block_size, m_file );
-    m_end = m_start + readed;
-    m_current   -= m_block_size;
-    m_block_pos += m_block_size;
+void  WBaseStream::WriteBlock()
+{
+    int size = (int)(m_current - m_start);
+    assert( m_file != 0 );
 
-    if( readed == 0 || m_current >= m_end )
-    {
-        if( m_jmp_set )
-            longjmp( m_jmp_buf, RBS_THROW_EOS );
-    }
+    //fseek( m_file, m_block_pos, SEEK_SET );
+    if( size > 0 )
+        fwrite( m_start, 1, size, m_file );
+    m_current = m_start;
+
+    /*if( written < size ) throw RBS_THROW_EOS;*/
+    
+    m_block_pos += size;
 }
 
 
-bool  RBaseStream::Open( const char* filename )
+bool  WBaseStream::Open( const char* filename )
 {
     Close();
     Allocate();
     
-    m_file = fopen( filename, "rb" );
+    m_file = fopen( filename, "wb" );
     
     if( m_file )
     {
         m_is_opened = true;
-        SetPos(0);
+        m_block_pos = 0;
+        m_current = m_start;
     }
     return m_file != 0;
 }
 
-void  RBaseStream::Close()
+
+void  WBaseStream::Close()
 {
     if( m_file )
     {
+        WriteBlock();
         fclose( m_file );
         m_file = 0;
     }
@@ -532,650 +619,27 @@ void  RBaseStream::Close()
 }
 
 
-void  RBaseStream::Release()
+void  WBaseStream::Release()
 {
-    if( m_start )
-    {
-        delete[] (m_start - m_unGetsize);
-    }
     m_start = m_end = m_current = 0;
 }
 
 
-void  RBaseStream::SetBlockSize( int block_size, int unGetsize )
+void  WBaseStream::SetBlockSize( int block_size )
 {
-    assert( unGetsize >= 0 && block_size > 0 &&
-           (block_size & (block_size-1)) == 0 );
+    assert( block_size > 0 && (block_size & (block_size-1)) == 0 );
 
-    if( m_start && block_size == m_block_size && unGetsize == m_unGetsize ) return;
+    if( m_start && block_size == m_block_size ) return;
     Release();
-    m_block_size = block_size;
-    m_unGetsize = unGetsize;
+    m_block_size = BS_DEF_BLOCK_SIZE;
     Allocate();
 }
 
 
-void  RBaseStream::SetPos( int pos )
+int  WBaseStream::GetPos()
 {
-    int offset = pos & (m_block_size - 1);
-    int block_pos = pos - offset;
-    
-    assert( IsOpened() && pos >= 0 );
-    
-    if( m_current < m_end && block_pos == m_block_pos - m_block_size )
-    {
-        m_current = m_start + offset;
-    }
-    else
-    {
-        m_block_pos = block_pos;
-        m_current = m_start + m_block_size + offset;
-    }
-}
-
-
-int  RBaseStream::GetPos()
-{
-    assert( IsOpened() );
-    return m_block_pos - m_block_size + (int)(m_current - m_start);
-}
-
-void  RBaseStream::Skip( int bytes )
-{
-    assert( bytes >= 0 );
-    m_current += bytes;
-}
-
-jmp_buf& RBaseStream::JmpBuf()
-{ 
-    m_jmp_set = true;
-    return m_jmp_buf;
-}
-
-/////////////////////////  RLByteStream ////////////////////////////
-
-RLByteStream::~RLByteStream()
-{
-}
-
-int  RLByteStream::GetByte()
-{
-    uchar *current = m_current;
-    int   val;
-
-    if( current >= m_end )
-    {
-        ReadBlock();
-        current = m_current;
-    }
-
-    val = *((uchar*)current);
-    m_current = current + 1;
-    return val;
-}
-
-
-void  RLByteStream::GetBytes( void* buffer, int count, int* readed )
-{
-    uchar*  data = (uchar*)buffer;
-    assert( count >= 0 );
-    
-    if( readed) *readed = 0;
-
-    while( count > 0 )
-    {
-        int l;
-
-        for(;;)
-        {
-            l = (int)(m_end - m_current);
-            if( l > count ) l = count;
-            if( l > 0 ) break;
-            ReadBlock();
-        }
-        memcpy( data, m_current, l );
-        m_current += l;
-        data += l;
-        count -= l;
-        if( readed ) *readed += l;
-    }
-}
-
-
-////////////  RLByteStream & RMByteStream <Get[d]word>s ////////////////
-
-RMByteStream::~RMByteStream()
-{
-}
-
-
-int  RLByteStream::GetWord()
-{
-    uchar *current = m_current;
-    int   val;
-
-    if( current+1 < m_end )
-    {
-        val = current[0] + (current[1] << 8);
-        m_current = current + 2;
-    }
-    else
-    {
-        val = GetByte();
-        val|= GetByte() << 8;
-    }
-    return val;
-}
-
-
-int  RLByteStream::GetDWord()
-{
-    uchar *current = m_current;
-    int   val;
-
-    if( current+3 < m_end )
-    {
-        val = current[0] + (current[1] << 8) +
-              (current[2] << 16) + (current[3] << 24);
-        m_current = current + 4;
-    }
-    else
-    {
-        val = GetByte();
-        val |= GetByte() << 8;
-        val |= GetByte() << 16;
-        val |= GetByte() << 24;
-    }
-    return val;
-}
-
-
-int  RMByteStream::GetWord()
-{
-    uchar *current = m_current;
-    int   val;
-
-    if( current+1 < m_end )
-    {
-        val = (current[0] << 8) + current[1];
-        m_current = current + 2;
-    }
-    else
-    {
-        val = GetByte() << 8;
-        val|= GetByte();
-    }
-    return val;
-}
-
-
-int  RMByteStream::GetDWord()
-{
-    uchar *current = m_current;
-    int   val;
-
-    if( current+3 < m_end )
-    {
-        val = (current[0] << 24) + (current[1] << 16) +
-              (current[2] << 8) + current[3];
-        m_current = current + 4;
-    }
-    else
-    {
-        val = GetByte() << 24;
-        val |= GetByte() << 16;
-        val |= GetByte() << 8;
-        val |= GetByte();
-    }
-    return val;
-}
-
-
-/////////////////////////  RLBitStream ////////////////////////////
-
-RLBitStream::~RLBitStream()
-{
-}
-
-
-void  RLBitStream::ReadBlock()
-{
-    RBaseStream::ReadBlock();
-    if( bsIsBigEndian() )
-        bsBSwapBlock( m_start, m_end );
-}
-
-
-void  RLBitStream::SetPos( int pos )
-{
-    RBaseStream::SetPos(pos);
-    int offset = (int)(m_current - m_end);
-    m_current = m_end + (offset & -4);
-    m_bit_idx = (offset&3)*8;
-}
-
-
-int  RLBitStream::GetPos()
-{
-    return RBaseStream::GetPos() + (m_bit_idx >> 3);
-}
-
-
-int  RLBitStream::Get( int bits )
-{
-    int    bit_idx     = m_bit_idx;
-    int    new_bit_idx = bit_idx + bits;
-    int    mask    = new_bit_idx >= 32 ? -1 : 0;
-    unsigned* current = (unsigned*)m_current;
-
-    assert( (unsigned)bits < 32 );
-
-    if( (m_current = (uchar*)(current - mask)) >= m_end )
-    {
-        ReadBlock();
-        current = ((unsigned*)m_current) + mask;
-    }
-    m_bit_idx = new_bit_idx & 31;
-    return ((current[0] >> bit_idx) |
-           ((current[1] <<-bit_idx) & mask)) & bs_bit_mask[bits];
-}
-
-int  RLBitStream::Show( int bits )
-{
-    int    bit_idx = m_bit_idx;
-    int    new_bit_idx = bit_idx + bits;
-    int    mask    = new_bit_idx >= 32 ? -1 : 0;
-    unsigned* current = (unsigned*)m_current;
-
-    assert( (unsigned)bits < 32 );
-
-    if( (uchar*)(current - mask) >= m_end )
-    {
-        ReadBlock();
-        current = ((unsigned*)m_current) + mask;
-        m_current = (uchar*)current;
-    }
-    return ((current[0] >> bit_idx) |
-           ((current[1] <<-bit_idx) & mask)) & bs_bit_mask[bits];
-}
-
-
-void  RLBitStream::Move( int shift )
-{
-    int new_bit_idx = m_bit_idx + shift;
-    m_current += (new_bit_idx >> 5) << 2;
-    m_bit_idx  = new_bit_idx & 31;
-}
-
-
-int  RLBitStream::GetHuff( const short* table )
-{
-    int  val;
-    int  code_bits;
-
-    for(;;)
-    {
-        int table_bits = table[0];
-        val = table[Show(table_bits) + 2];
-        code_bits = val & 15;
-        val >>= 4;
-
-        if( code_bits != 0 ) break;
-        table += val*2;
-        Move( table_bits );
-    }
-
-    Move( code_bits );
-    if( val == RBS_HUFF_FORB )
-    {
-        if( m_jmp_set )
-            longjmp( m_jmp_buf, RBS_THROW_FORB );
-    }
-
-    return val;
-}
-
-void  RLBitStream::Skip( int bytes )
-{
-    Move( bytes*8 );
-}
-
-/////////////////////////  RMBitStream ////////////////////////////
-
-
-RMBitStream::~RMBitStream()
-{
-}
-
-
-void  RMBitStream::ReadBlock()
-{
-    RBaseStream::ReadBlock();
-    if( !bsIsBigEndian() )
-        bsBSwapBlock( m_start, m_end );
-}
-
-
-void  RMBitStream::SetPos( int pos )
-{
-    RBaseStream::SetPos(pos);
-    int offset = (int)(m_current - m_end);
-    m_current = m_end + ((offset - 1) & -4);
-    m_bit_idx = (32 - (offset&3)*8) & 31;
-}
-
-
-int  RMBitStream::GetPos()
-{
-    return RBaseStream::GetPos() + ((32 - m_bit_idx) >> 3);
-}
-
-
-int  RMBitStream::Get( int bits )
-{
-    int    bit_idx = m_bit_idx - bits;
-    int    mask    = bit_idx >> 31;
-    unsigned* current = ((unsigned*)m_current) - mask;
-
-    assert( (unsigned)bits < 32 );
-
-    if( (m_current = (uchar*)current) >= m_end )
-    {
-        ReadBlock();
-        current = (unsigned*)m_current;
-    }
-    m_bit_idx = bit_idx &= 31;
-    return (((current[-1] << -bit_idx) & mask)|
-             (current[0] >> bit_idx)) & bs_bit_mask[bits];
-}
-
-
-int  RMBitStream::Show( int bits )
-{
-    int    bit_idx = m_bit_idx - bits;
-    int    mask    = bit_idx >> 31;
-    unsigned* current = ((unsigned*)m_current) - mask;
-
-    assert( (unsigned)bits < 32 );
-
-    if( ((uchar*)current) >= m_end )
-    {
-        m_current = (uchar*)current;
-        ReadBlock();
-        current = (unsigned*)m_current;
-        m_current -= 4;
-    }
-    return (((current[-1]<<-bit_idx) & mask)|
-             (current[0] >> bit_idx)) & bs_bit_mask[bits];
-}
-
-
-int  RMBitStream::GetHuff( const short* table )
-{
-    int  val;
-    int  code_bits;
-
-    for(;;)
-    {
-        int table_bits = table[0];
-        val = table[Show(table_bits) + 1];
-        code_bits = val & 15;
-        val >>= 4;
-
-        if( code_bits != 0 ) break;
-        table += val;
-        Move( table_bits );
-    }
-
-    Move( code_bits );
-    if( val == RBS_HUFF_FORB )
-    {
-        if( m_jmp_set )
-            longjmp( m_jmp_buf, RBS_THROW_FORB );
-    }
-
-    return val;
-}
-
-
-void  RMBitStream::Move( int shift )
-{
-    int new_bit_idx = m_bit_idx - shift;
-    m_current -= (new_bit_idx >> 5)<<2;
-    m_bit_idx  = new_bit_idx & 31;
-}
-
-
-void  RMBitStream::Skip( int bytes )
-{
-    Move( bytes*8 );
-}
-
-
-static const int huff_val_shift = 20, huff_code_mask = (1 << huff_val_shift) - 1;
-
-bool bsCreateDecodeHuffmanTable( const int* src, short* table, int max_size )
-{   
-    const int forbidden_entry = (RBS_HUFF_FORB << 4)|1;
-    int       first_bits = src[0];
-    struct
-    {
-        int bits;
-        int offset;
-    }
-    sub_tables[1 << 11];
-    int  size = (1 << first_bits) + 1;
-    int  i, k;
-    
-    /* calc bit depths of sub tables */
-    memset( sub_tables, 0, ((size_t)1 << first_bits)*sizeof(sub_tables[0]) );
-    for( i = 1, k = 1; src[k] >= 0; i++ )
-    {
-        int code_count = src[k++];
-        int sb = i - first_bits;
-        
-        if( sb <= 0 )
-            k += code_count;
-        else
-            for( code_count += k; k < code_count; k++ )
-            {
-                int  code = src[k] & huff_code_mask;
-                sub_tables[code >> sb].bits = sb;
-            }
-    }
-
-    /* calc offsets of sub tables and whole size of table */
-    for( i = 0; i < (1 << first_bits); i++ )
-    {
-        int b = sub_tables[i].bits;
-        if( b > 0 )
-        {
-            b = 1 << b;
-            sub_tables[i].offset = size;
-            size += b + 1;
-        }
-    }
-
-    if( size > max_size )
-    {
-        assert(0);
-        return false;
-    }
-
-    /* fill first table and subtables with forbidden values */
-    for( i = 0; i < size; i++ )
-    {
-        table[i] = (short)forbidden_entry;
-    }
-
-    /* write header of first table */
-    table[0] = (short)first_bits;
-
-    /* fill first table and sub tables */ 
-    for( i = 1, k = 1; src[k] >= 0; i++ )
-    {
-        int code_count = src[k++];
-        for( code_count += k; k < code_count; k++ )
-        {
-            int  table_bits= first_bits;
-            int  code_bits = i;
-            int  code = src[k] & huff_code_mask;
-            int  val  = src[k] >>huff_val_shift;
-            int  j, offset = 0;
-
-            if( code_bits > table_bits )
-            {
-                int idx = code >> (code_bits -= table_bits);
-                code &= (1 << code_bits) - 1;
-                offset   = sub_tables[idx].offset;
-                table_bits= sub_tables[idx].bits;
-                /* write header of subtable */
-                table[offset]  = (short)table_bits;
-                /* write jump to subtable */
-                table[idx + 1]= (short)(offset << 4);
-            }
-        
-            table_bits -= code_bits;
-            assert( table_bits >= 0 );
-            val = (val << 4) | code_bits;
-            offset += (code << table_bits) + 1;
-        
-            for( j = 0; j < (1 << table_bits); j++ )
-            {
-                assert( table[offset + j] == forbidden_entry );
-                table[ offset + j ] = (short)val;
-            }
-        }
-    }
-    return true;
-}
-
-
-int*  bsCreateSourceHuffmanTable( const uchar* src, int* dst,
-                                  int max_bits, int first_bits )
-{
-    int   i, val_idx, code = 0;
-    int*  table = dst;
-    *dst++ = first_bits;
-    for( i = 1, val_idx = max_bits; i <= max_bits; i++ )
-    {
-        int code_count = src[i - 1];
-        dst[0] = code_count;
-        code <<= 1;
-        for( int k = 0; k < code_count; k++ )
-        {
-            dst[k + 1] = (src[val_idx + k] << huff_val_shift)|(code + k);
-        }
-        code += code_count;
-        dst += code_count + 1;
-        val_idx += code_count;
-    }
-    dst[0] = -1;
-    return  table;
-}
-
-
-/////////////////////////// WBaseStream /////////////////////////////////
-
-// WBaseStream - base class for output streams
-WBaseStream::WBaseStream()
-{
-    m_start = m_end = m_current = 0;
-    m_file = 0;
-    m_block_size = BS_DEF_BLOCK_SIZE;
-    m_is_opened = false;
-}
-
-
-WBaseStream::~WBaseStream()
-{
-    Close();    // Close files
-    Release();  // free  buffers
-}
-
-
-bool  WBaseStream::IsOpened()
-{ 
-    return m_is_opened;
-}
-
-
-void  WBaseStream::Allocate()
-{
-    if( !m_start )
-        m_start = &m_buf[0];
-
-    m_end = m_start + m_block_size;
-    m_current = m_start;
-}
-
-
-void  WBaseStream::WriteBlock()
-{
-    int size = (int)(m_current - m_start);
-    assert( m_file != 0 );
-
-    //fseek( m_file, m_block_pos, SEEK_SET );
-    if( size > 0 )
-        fwrite( m_start, 1, size, m_file );
-    m_current = m_start;
-
-    /*if( written < size ) throw RBS_THROW_EOS;*/
-    
-    m_block_pos += size;
-}
-
-
-bool  WBaseStream::Open( const char* filename )
-{
-    Close();
-    Allocate();
-    
-    m_file = fopen( filename, "wb" );
-    
-    if( m_file )
-    {
-        m_is_opened = true;
-        m_block_pos = 0;
-        m_current = m_start;
-    }
-    return m_file != 0;
-}
-
-
-void  WBaseStream::Close()
-{
-    if( m_file )
-    {
-        WriteBlock();
-        fclose( m_file );
-        m_file = 0;
-    }
-    m_is_opened = false;
-}
-
-
-void  WBaseStream::Release()
-{
-    m_start = m_end = m_current = 0;
-}
-
-
-void  WBaseStream::SetBlockSize( int block_size )
-{
-    assert( block_size > 0 && (block_size & (block_size-1)) == 0 );
-
-    if( m_start && block_size == m_block_size ) return;
-    Release();
-    m_block_size = BS_DEF_BLOCK_SIZE;
-    Allocate();
-}
-
-
-int  WBaseStream::GetPos()
-{
-    assert( IsOpened() );
-    return m_block_pos + (int)(m_current - m_start);
+    assert( IsOpened() );
+    return m_block_pos + (int)(m_current - m_start);
 }
 
 
@@ -1472,37 +936,143 @@ bool bsCreateEncodeHuffmanTable( const int* src, unsigned* table, int max_size )
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-class RJpegBitStream : public RMBitStream
+// JpegByteReader - reader of the marker segments from memory.
+// Reading past the end gives zeros and sets the eos flag, which is checked by the callers
+class JpegByteReader
 {
 public:
-    RMByteStream  m_low_strm;
+    JpegByteReader() { Init( 0, 0 ); }
 
-    RJpegBitStream();
-    ~RJpegBitStream();
+    void  Init( const uchar* start, const uchar* end )
+    {
+        m_start = m_current = start;
+        m_end = end;
+        m_eos = false;
+    }
 
-    virtual bool  Open( const char* filename );
-    virtual void  Close();
+    int   GetByte()
+    {
+        if( m_current < m_end )
+            return *m_current++;
+        m_eos = true;
+        return 0;
+    }
 
-    void  Flush(); // flushes high-level bit stream
-    void  AlignOnByte();
-    int   FindMarker();
+    int   GetWord() { int val = GetByte() << 8; return val | GetByte(); }
+    void  GetBytes( void* buffer, int count );
+    int   GetPos() const { return (int)(m_current - m_start); }
+    void  SetPos( int pos );
+    void  Skip( int bytes ) { SetPos( GetPos() + bytes ); }
+    const uchar* GetPtr() const { return m_current; }
+    void  SetPtr( const uchar* ptr ) { SetPos( (int)(ptr - m_start) ); }
+    bool  IsEOS() const { return m_eos; }
+    int   FindMarker(); // -1 at the end of the data
 
 protected:
-    virtual void  ReadBlock();
+    const uchar* m_start;
+    const uchar* m_end;
+    const uchar* m_current;
+    bool  m_eos;
 };
 
 
+// JpegBitReader - reader of the entropy-coded data from memory.
+// The data must be terminated by a marker (the decoder always appends EOI), so the
+// refill is not bounds-checked: at a marker the bit buffer is padded with zeros,
+// and consuming the padding is reported by Overrun(), checked once per MCU
+class JpegBitReader
+{
+public:
+    JpegBitReader() { Init( 0 ); }
+
+    void  Init( const uchar* ptr )
+    {
+        m_ptr = ptr;
+        m_bits = 0;
+        m_nbits = m_pad = 0;
+    }
+
+    // makes at least 32 bits available
+    inline void  Refill()
+    {
+        if( m_nbits >= 32 )
+            return;
+        while( m_nbits <= 56 )
+        {
+            int val = m_ptr[0];
+            if( val == 0xFF )
+            {
+                if( m_ptr[1] != 0 ) // a marker: stay on it and pad the buffer
+                {
+                    m_pad += 64 - m_nbits;
+                    m_nbits = 64;
+                    break;
+                }
+                m_ptr++; // stuffed zero
+            }
+            m_ptr++;
+            m_bits |= (uint64)val << (56 - m_nbits);
+            m_nbits += 8;
+        }
+    }
+
+    // Show/Move/Get must be preceded by Refill; 0 < bits <= 16 for Show, bits < 32 for Get
+    inline int   Show( int bits ) const { return (int)(m_bits >> (64 - bits)); }
+    inline void  Move( int bits ) { m_bits <<= bits; m_nbits -= bits; }
+    inline int   Get( int bits )
+    {
+        int val = (int)((m_bits >> 1) >> (63 - bits));
+        Move( bits );
+        return val;
+    }
+    int   GetHuff( const short* table );
+
+    bool  Overrun() const { return m_nbits < m_pad; }
+    const uchar* GetPtr() const { return m_ptr; }
+    void  Restart(); // drops the rest of the byte and skips the restart marker
+    bool  SkipRestartIntervals( int count );
+    bool  FindRestartIntervals( int count, std::vector<const uchar*>& starts ) const;
+
+protected:
+    const uchar* m_ptr;
+    uint64  m_bits; // the next bits of the stream, most significant first
+    int     m_nbits;
+    int     m_pad; // zero bits added at a marker
+};
 //////////////////// JPEG reader /////////////////////
 
+// dequantization multipliers of a quantization table (including the IDCT prescaling)
+// and their 16-bit halves for the SIMD IDCT: tq = tq_hi*65536 + tq_lo
+struct QuantTable
+{
+    int     tq[64];
+    short   tq_hi[64], tq_lo[64];
+    ushort  q[64]; // the table as it is stored, in the order of the coefficients of the blocks
+};
+
+struct JpegScan;
+
 class GrFmtJpegReader
 {
 public:
 
-    GrFmtJpegReader( const char* filename );
+    GrFmtJpegReader( const char* filename = 0 );
     ~GrFmtJpegReader();
 
-    bool  ReadData( uchar* data, int step, int color );
+    // scale is the downscaling factor: 1, 2, 4 or 8. roi is the decoded part
+    // of the downscaled image, the whole image if it is empty.
+    // If data is 0, only the coefficients are decoded (see GetCoefficients)
+    bool  ReadData( uchar* data, int step, int colorspace, int scale = 1, Rect roi = Rect() );
+    // the coefficients decoded by ReadData, valid until the next image is read
+    void  GetCoefficients( JpegCoefficients& coeffs ) const;
     bool  ReadHeader();
+    // reads the image from memory; the data is not copied if it ends with EOI,
+    // and then it must stay valid until ReadData is finished
+    bool  ReadHeader( const uchar* data, size_t size );
+    // decode the restart intervals of the image in parallel, if it has them
+    void  SetParallel( bool parallel ) { m_parallel = parallel; }
+    // decodes a part of the scan, may be called concurrently for different restart intervals
+    bool  DecodeMCUs( const JpegScan& scan, JpegBitReader& strm, int mcu1, int mcu2 ) const;
     void  Close();
     int m_width, m_height, m_iscolor;
 
@@ -1523,12 +1093,11 @@ protected:
         char v;  // vertical   sampling factor
         char tq; // quantization table index
         char td, ta; // DC & AC huffman tables
-        int  dc_pred; // DC predictor
     };
 
     cmp_info m_ci[3];
 
-    int     m_tq[4][64];
+    QuantTable m_tq[4];
     bool    m_is_tq[4];
 
     short*  m_td[4];
@@ -1536,243 +1105,961 @@ protected:
 
     short*  m_ta[4];
     bool    m_is_ta[4];
+
+    // single lookup tables for the short codes (see bsCreateFastHuffmanTable)
+    int*    m_td_fast[4];
+    int*    m_ta_fast[4];
+
+    // the segments the tables are built from. The tables are kept between the images
+    // and built again only if their segments change (usually they do not in a stream)
+    uchar   m_tq_src[4][128];
+    uchar   m_td_src[4][16 + 256];
+    uchar   m_ta_src[4][16 + 256];
+    int     m_tq_src_size[4], m_td_src_size[4], m_ta_src_size[4];
     
-    RJpegBitStream  m_strm;
+    std::vector<uchar> m_buf; // the file, followed by EOI
+    JpegByteReader  m_low_strm;
+    JpegBitReader   m_strm;
     const char*   m_filename;
+    bool    m_parallel;
+    std::vector<const uchar*> m_starts; // starts of the restart intervals
+
+    // coefficients of a progressive image, the blocks of each component in raster order
+    std::vector<short> m_coeffs;
+    short*  m_coeff[3];
+    int     m_coeff_step[3]; // blocks per row
 
 protected:
     
+    bool  LoadFile( const char* filename );
+    bool  ParseHeader();
     bool  LoadQuantTables( int length );
     bool  LoadHuffmanTables( int length );
-    void  ProcessScan( int* idx, int ns, uchar* data, int step, int color );
-    void  ResetDecoder();
-    void  GetBlock( int* block, int c );
+    void  LoadDefaultHuffmanTables();
+    void  InitScan( JpegScan& scan, uchar* data, int step, int colorspace, int scale, Rect roi ) const;
+    bool  ProcessScan( int* idx, int ns, uchar* data, int step, int colorspace, int scale, Rect roi );
+    int   GetBlock( JpegBitReader& strm, short* block, int c, int& dc_pred ) const;
+
+    void  AllocCoefficients();
+    bool  ProcessCoefficientScan( const int* idx, int ns );
+    bool  GetProgressiveBlock( short* block, int c, int& dc_pred, int& eobrun );
+    bool  StoreCoefficients( uchar* data, int step, int colorspace, int scale, Rect roi );
 };
 
-RJpegBitStream::RJpegBitStream()
-{
+void  JpegByteReader::GetBytes( void* buffer, int count )
+{
+    int avail = (int)(m_end - m_current);
+    if( count > avail )
+    {
+        memset( (uchar*)buffer + avail, 0, count - avail );
+        count = avail;
+        m_eos = true;
+    }
+    memcpy( buffer, m_current, count );
+    m_current += count;
+}
+
+
+void  JpegByteReader::SetPos( int pos )
+{
+    if( 0 <= pos && pos <= m_end - m_start )
+        m_current = m_start + pos;
+    else
+    {
+        m_current = m_end;
+        m_eos = true;
+    }
+}
+
+
+int  JpegByteReader::FindMarker()
+{
+    int code = GetWord();
+    while( (code & 0xFF00) != 0xFF00 || (code == 0xFFFF || code == 0xFF00 ))
+    {
+        if( m_eos )
+            return -1;
+        code = ((code&255) << 8) | GetByte();
+    }
+    return m_eos ? -1 : code;
+}
+
+
+int  JpegBitReader::GetHuff( const short* table )
+{
+    int  val;
+    int  code_bits;
+
+    for(;;)
+    {
+        int table_bits = table[0];
+        val = table[Show(table_bits) + 1];
+        code_bits = val & 15;
+        val >>= 4;
+
+        if( code_bits != 0 ) break;
+        table += val;
+        Move( table_bits );
+    }
+
+    Move( code_bits );
+    return val;
+}
+
+
+void  JpegBitReader::Restart()
+{
+    m_bits = 0;
+    m_nbits = m_pad = 0;
+
+    // only the padding of the last byte is expected before the marker
+    for( ;; m_ptr++ )
+    {
+        if( m_ptr[0] != 0xFF )
+            continue;
+        int val = m_ptr[1];
+        if( 0xD0 <= val && val <= 0xD7 )
+        {
+            m_ptr += 2;
+            break;
+        }
+        if( val != 0 && val != 0xFF )
+            break; // another marker is left to the caller
+    }
+}
+
+
+// skips the entropy-coded data up to and including the count-th restart marker
+bool  JpegBitReader::SkipRestartIntervals( int count )
+{
+    Init( m_ptr );
+    while( count > 0 )
+    {
+        if( m_ptr[0] != 0xFF )
+        {
+            m_ptr++;
+            continue;
+        }
+        int val = m_ptr[1];
+        if( 0xD0 <= val && val <= 0xD7 )
+            count--;
+        else if( val != 0 && val != 0xFF )
+            return false;
+        m_ptr += val == 0xFF ? 1 : 2;
+    }
+    return true;
+}
+// finds the starts of count restart intervals, the first one being at the current position
+bool  JpegBitReader::FindRestartIntervals( int count, std::vector<const uchar*>& starts ) const
+{
+    const uchar* ptr = m_ptr;
+
+    starts.resize( count );
+    starts[0] = ptr;
+    for( int i = 1; i < count; )
+    {
+        if( ptr[0] != 0xFF )
+        {
+            ptr++;
+            continue;
+        }
+        int val = ptr[1];
+        ptr += val == 0xFF ? 1 : 2;
+        if( 0xD0 <= val && val <= 0xD7 )
+            starts[i++] = ptr;
+        else if( val != 0 && val != 0xFF )
+            return false;
+    }
+    return true;
+}
+
+
+// the IDCTs take quantized coefficients and dequantize them on load
+#define  dequant(src, tq, i)  descale((src)[i]*(tq)[i], 16)
+
+// IDCT without prescaling. The rows of src starting from nrows must be zero
+static void aan_idct8x8_rows( const short *src, const QuantTable& qt, short *dst, int step, int nrows )
+{
+    int   workspace[64], *work = workspace;
+    const int* tq = qt.tq;
+    int   i;
+
+    /* Pass 1: process rows */
+    for( i = nrows; i > 0; i--, src += 8, tq += 8, work += 8 )
+    {
+        /* Odd part */
+        int  x0 = dequant(src, tq, 5), x1 = dequant(src, tq, 3);
+        int  x2 = dequant(src, tq, 1), x3 = dequant(src, tq, 7);
+
+        int  x4 = x0 + x1; x0 -= x1;
+
+        x1 = x2 + x3; x2 -= x3;
+        x3 = x1 + x4; x1 -= x4;
+
+        x4 = (x0 + x2)*C1_847;
+        x0 = descale( x4 - x0*C2_613, fixb);
+        x2 = descale( x2*C1_082 - x4, fixb);
+        x1 = descale( x1*C1_414, fixb);
+
+        x0 -= x3;
+        x1 -= x0;
+        x2 += x1;
+
+        work[7] = x3; work[6] = x0;
+        work[5] = x1; work[4] = x2;
+
+        /* Even part */
+        x2 = dequant(src, tq, 2); x3 = dequant(src, tq, 6);
+        x0 = dequant(src, tq, 0); x1 = dequant(src, tq, 4);
+
+        x4 = x2 + x3;
+        x2 = descale((x2-x3)*C1_414, fixb) - x4;
+
+        x3 = x0 + x1; x0 -= x1;
+        x1 = x3 + x4; x3 -= x4;
+        x4 = x0 + x2; x0 -= x2;
+
+        x2 = work[7];
+        x1 -= x2; x2 = 2*x2 + x1;
+        work[7] = x1; work[0] = x2;
+
+        x2 = work[6];
+        x1 = x4 + x2; x4 -= x2;
+        work[1] = x1; work[6] = x4;
+
+        x1 = work[5]; x2 = work[4];
+        x4 = x0 + x1; x0 -= x1;
+        x1 = x3 + x2; x3 -= x2;
+
+        work[2] = x4; work[5] = x0;
+        work[3] = x3; work[4] = x1;
+    }
+    memset( work, 0, (8 - nrows)*8*sizeof(work[0]) );
+
+    /* Pass 2: process columns */
+    work = workspace;
+    for( i = 8; i > 0; i--, dst += step, work++ )
+    {
+        /* Odd part */
+        int  x0 = work[8*5], x1 = work[8*3];
+        int  x2 = work[8*1], x3 = work[8*7];
+
+        int  x4 = x0 + x1; x0 -= x1;
+        x1 = x2 + x3; x2 -= x3;
+        x3 = x1 + x4; x1 -= x4;
+
+        x4 = (x0 + x2)*C1_847;
+        x0 = descale( x4 - x0*C2_613, fixb);
+        x2 = descale( x2*C1_082 - x4, fixb);
+        x1 = descale( x1*C1_414, fixb);
+
+        x0 -= x3;
+        x1 -= x0;
+        x2 += x1;
+
+        // the odd part is kept in registers: the output is 16-bit
+        // and can not hold the intermediate (8x scaled) values
+        int  o7 = x3, o6 = x0, o5 = x1, o4 = x2;
+
+        /* Even part */
+        x2 = work[8*2]; x3 = work[8*6];
+        x0 = work[8*0]; x1 = work[8*4];
+
+        x4 = x2 + x3;
+        x2 = descale((x2-x3)*C1_414, fixb) - x4;
+
+        x3 = x0 + x1; x0 -= x1;
+        x1 = x3 + x4; x3 -= x4;
+        x4 = x0 + x2; x0 -= x2;
+
+        x2 = o7;
+        x1 -= x2; x2 = 2*x2 + x1;
+        x1 = descale(x1,3);
+        x2 = descale(x2,3);
+
+        dst[7] = (short)x1; dst[0] = (short)x2;
+
+        x2 = o6;
+        x1 = descale(x4 + x2,3);
+        x4 = descale(x4 - x2,3);
+        dst[1] = (short)x1; dst[6] = (short)x4;
+
+        x1 = o5; x2 = o4;
+
+        x4 = descale(x0 + x1,3);
+        x0 = descale(x0 - x1,3);
+        x1 = descale(x3 + x2,3);
+        x3 = descale(x3 - x2,3);
+
+        dst[2] = (short)x4; dst[5] = (short)x0;
+        dst[3] = (short)x3; dst[4] = (short)x1;
+    }
+}
+
+static void aan_idct8x8( const short *src, const QuantTable& qt, short *dst, int step )
+{
+    aan_idct8x8_rows( src, qt, dst, step, 8 );
+}
+
+// the nonzero coefficients are in the 4x4 low-frequency corner
+static void aan_idct8x8_low( const short *src, const QuantTable& qt, short *dst, int step )
+{
+    aan_idct8x8_rows( src, qt, dst, step, 4 );
+}
+
+// DC only: all the samples are the same, as given by aan_idct8x8
+static void idct8x8_dc( const short *src, const QuantTable& qt, short *dst, int step )
+{
+    short val = (short)descale( dequant(src, qt.tq, 0), 3 );
+    int   i;
+#ifdef WITH_SSE2
+    __m128i v = _mm_set1_epi16(val);
+    for( i = 0; i < 8; i++ )
+        _mm_storeu_si128((__m128i*)(dst + i*step), v);
+#else
+    for( i = 0; i < 8; i++ )
+    {
+        short* d = dst + i*step;
+        d[0] = d[1] = d[2] = d[3] = d[4] = d[5] = d[6] = d[7] = val;
+    }
+#endif
+}
+
+
+// Reduced IDCTs for the scaled decoding. They take the low-frequency corner of the block
+// (prescaled the same way as for aan_idct8x8) and produce the block downscaled 2x, 4x or 8x.
+// The weights are cos((2x+1)*u*pi/N)/(2*sqrt(2)), multiplied by the factors that make
+// each output sample the average of the full-size samples it covers.
+
+// 4x4 output from the 4x4 low frequencies
+static void idct4x4( const short *src, const QuantTable& qt, short *dst, int step )
+{
+    int   workspace[16], *work = workspace;
+    const int* tq = qt.tq;
+    int   i;
+
+    /* Pass 1: process rows */
+    for( i = 4; i > 0; i--, src += 8, tq += 8, work += 4 )
+    {
+        int  s1 = dequant(src, tq, 1), s3 = dequant(src, tq, 3);
+        int  x0 = dequant(src, tq, 0)*C0_354, x2 = dequant(src, tq, 2)*C0_250;
+        int  e0 = x0 + x2, e1 = x0 - x2;
+        int  o0 = s1*C0_327 + s3*C0_135;
+        int  o1 = s1*C0_135 - s3*C0_327;
+
+        work[0] = descale( e0 + o0, fixb ); work[3] = descale( e0 - o0, fixb );
+        work[1] = descale( e1 + o1, fixb ); work[2] = descale( e1 - o1, fixb );
+    }
+
+    /* Pass 2: process columns */
+    work = workspace;
+    for( i = 4; i > 0; i--, dst += step, work++ )
+    {
+        int  x0 = work[4*0]*C0_354, x2 = work[4*2]*C0_250;
+        int  e0 = x0 + x2, e1 = x0 - x2;
+        int  o0 = work[4*1]*C0_327 + work[4*3]*C0_135;
+        int  o1 = work[4*1]*C0_135 - work[4*3]*C0_327;
+
+        dst[0] = (short)descale( e0 + o0, fixb ); dst[3] = (short)descale( e0 - o0, fixb );
+        dst[1] = (short)descale( e1 + o1, fixb ); dst[2] = (short)descale( e1 - o1, fixb );
+    }
+}
+
+
+// 2x2 output from the 2x2 low frequencies
+static void idct2x2( const short *src, const QuantTable& qt, short *dst, int step )
+{
+    const int* tq = qt.tq;
+    int  x0 = dequant(src, tq, 0)*C0_354, x1 = dequant(src, tq, 1)*C0_231;
+    int  r0 = descale( x0 + x1, fixb ), r1 = descale( x0 - x1, fixb );
+
+    x0 = dequant(src, tq, 8)*C0_354; x1 = dequant(src, tq, 9)*C0_231;
+    int  s0 = descale( x0 + x1, fixb ), s1 = descale( x0 - x1, fixb );
+
+    dst[0] = (short)descale( r0*C0_354 + s0*C0_231, fixb );
+    dst[1] = (short)descale( r0*C0_354 - s0*C0_231, fixb );
+    dst[step] = (short)descale( r1*C0_354 + s1*C0_231, fixb );
+    dst[step + 1] = (short)descale( r1*C0_354 - s1*C0_231, fixb );
+}
+
+
+// DC only: a single sample per block
+static void idct1x1( const short *src, const QuantTable& qt, short *dst, int /*step*/ )
+{
+    dst[0] = (short)descale( dequant(src, qt.tq, 0), 3 );
+}
+
+#ifdef WITH_SSE2
+
+// descale(a*k0 + b*k1, fixb) for 8 pairs; k holds (k0, k1) pairs
+static inline __m128i idct_mul_sse2( __m128i a, __m128i b, __m128i k )
+{
+    __m128i delta = _mm_set1_epi32(1 << (fixb - 1));
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, delta), fixb);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, delta), fixb);
+    return _mm_packs_epi32(lo, hi);
+}
+
+// the (k0, k1) pairs of idct_mul_sse2 of the passes, packed in unsigned arithmetic
+// as the constants may be negative or shifted out of int
+static const int idct_k_1_414 = C1_414 & 0xffff;
+static const int idct_k_odd0 = (int)(((unsigned)(C1_847 - C2_613) & 0xffff) | ((unsigned)C1_847 << 16));
+static const int idct_k_odd2 = (int)(((unsigned)-C1_847 & 0xffff) | ((unsigned)(C1_082 - C1_847) << 16));
+
+// 1D AAN IDCT of 8 vectors (the same as the passes of aan_idct8x8);
+// the products are computed in 32 bits as in the scalar code
+static inline void idct1d_sse2( __m128i* x )
+{
+    __m128i z = _mm_setzero_si128();
+    __m128i k_1_414 = _mm_set1_epi32(idct_k_1_414);
+    __m128i k_odd0 = _mm_set1_epi32(idct_k_odd0);
+    __m128i k_odd2 = _mm_set1_epi32(idct_k_odd2);
+
+    /* Odd part */
+    __m128i x4 = _mm_add_epi16(x[5], x[3]), x0 = _mm_sub_epi16(x[5], x[3]);
+    __m128i x1 = _mm_add_epi16(x[1], x[7]), x2 = _mm_sub_epi16(x[1], x[7]);
+    __m128i x3 = _mm_add_epi16(x1, x4);
+    x1 = _mm_sub_epi16(x1, x4);
+
+    x4 = idct_mul_sse2(x0, x2, k_odd0);
+    x2 = idct_mul_sse2(x0, x2, k_odd2);
+    x1 = idct_mul_sse2(x1, z, k_1_414);
+
+    __m128i o7 = x3;
+    __m128i o6 = _mm_sub_epi16(x4, x3);
+    __m128i o5 = _mm_sub_epi16(x1, o6);
+    __m128i o4 = _mm_add_epi16(x2, o5);
+
+    /* Even part */
+    x4 = _mm_add_epi16(x[2], x[6]);
+    x2 = _mm_sub_epi16(idct_mul_sse2(_mm_sub_epi16(x[2], x[6]), z, k_1_414), x4);
+
+    x3 = _mm_add_epi16(x[0], x[4]);
+    x0 = _mm_sub_epi16(x[0], x[4]);
+    x1 = _mm_add_epi16(x3, x4); x3 = _mm_sub_epi16(x3, x4);
+    x4 = _mm_add_epi16(x0, x2); x0 = _mm_sub_epi16(x0, x2);
+
+    x[0] = _mm_add_epi16(x1, o7); x[7] = _mm_sub_epi16(x1, o7);
+    x[1] = _mm_add_epi16(x4, o6); x[6] = _mm_sub_epi16(x4, o6);
+    x[2] = _mm_add_epi16(x0, o5); x[5] = _mm_sub_epi16(x0, o5);
+    x[4] = _mm_add_epi16(x3, o4); x[3] = _mm_sub_epi16(x3, o4);
 }
 
-RJpegBitStream::~RJpegBitStream()
+// idct1d_sse2 for x[4..7] being zero; the results are the same
+static inline void idct1d_low_sse2( __m128i* x )
 {
-    Close();
-}
+    __m128i z = _mm_setzero_si128();
+    __m128i k_1_414 = _mm_set1_epi32(idct_k_1_414);
+    __m128i k_odd0 = _mm_set1_epi32(idct_k_odd0);
+    __m128i k_odd2 = _mm_set1_epi32(idct_k_odd2);
 
+    /* Odd part */
+    __m128i x0 = _mm_sub_epi16(z, x[3]);
+    __m128i x3 = _mm_add_epi16(x[1], x[3]), x1 = _mm_sub_epi16(x[1], x[3]);
 
-bool  RJpegBitStream::Open( const char* filename )
-{
-    Close();
-    Allocate();
+    __m128i x4 = idct_mul_sse2(x0, x[1], k_odd0);
+    __m128i x2 = idct_mul_sse2(x0, x[1], k_odd2);
+    x1 = idct_mul_sse2(x1, z, k_1_414);
 
-    m_is_opened = m_low_strm.Open( filename );
-    if( m_is_opened ) SetPos(0);
-    return m_is_opened;
-}
+    __m128i o7 = x3;
+    __m128i o6 = _mm_sub_epi16(x4, x3);
+    __m128i o5 = _mm_sub_epi16(x1, o6);
+    __m128i o4 = _mm_add_epi16(x2, o5);
 
+    /* Even part */
+    x4 = x[2];
+    x2 = _mm_sub_epi16(idct_mul_sse2(x[2], z, k_1_414), x4);
 
-void  RJpegBitStream::Close()
-{
-    m_low_strm.Close();
-    m_is_opened = false;
+    x1 = _mm_add_epi16(x[0], x4); x3 = _mm_sub_epi16(x[0], x4);
+    x4 = _mm_add_epi16(x[0], x2); x0 = _mm_sub_epi16(x[0], x2);
+
+    x[0] = _mm_add_epi16(x1, o7); x[7] = _mm_sub_epi16(x1, o7);
+    x[1] = _mm_add_epi16(x4, o6); x[6] = _mm_sub_epi16(x4, o6);
+    x[2] = _mm_add_epi16(x0, o5); x[5] = _mm_sub_epi16(x0, o5);
+    x[4] = _mm_add_epi16(x3, o4); x[3] = _mm_sub_epi16(x3, o4);
 }
 
+static inline void transpose8x8_sse2( __m128i* x )
+{
+    __m128i a0 = _mm_unpacklo_epi16(x[0], x[1]), a1 = _mm_unpackhi_epi16(x[0], x[1]);
+    __m128i a2 = _mm_unpacklo_epi16(x[2], x[3]), a3 = _mm_unpackhi_epi16(x[2], x[3]);
+    __m128i a4 = _mm_unpacklo_epi16(x[4], x[5]), a5 = _mm_unpackhi_epi16(x[4], x[5]);
+    __m128i a6 = _mm_unpacklo_epi16(x[6], x[7]), a7 = _mm_unpackhi_epi16(x[6], x[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+
+    x[0] = _mm_unpacklo_epi64(b0, b4); x[1] = _mm_unpackhi_epi64(b0, b4);
+    x[2] = _mm_unpacklo_epi64(b1, b5); x[3] = _mm_unpackhi_epi64(b1, b5);
+    x[4] = _mm_unpacklo_epi64(b2, b6); x[5] = _mm_unpackhi_epi64(b2, b6);
+    x[6] = _mm_unpacklo_epi64(b3, b7); x[7] = _mm_unpackhi_epi64(b3, b7);
+}
 
-void  RJpegBitStream::ReadBlock()
+// 8x8 IDCT on 16-bit values. The dequantization gives the same values as the scalar one
+// (tq = tq_hi*65536 + tq_lo), the result may differ by a few units (by 1 in the samples) as
+// the passes are done in the other order and the intermediate values are 16-bit.
+// The rows of src starting from nrows must be zero
+static void aan_idct8x8_rows_sse2( const short *src, const QuantTable& qt, short *dst, int step, int nrows )
 {
-    uchar* end = m_start + m_block_size;
-    uchar* current = m_start;
+    __m128i x[8];
+    int   i;
 
-    if( setjmp( m_low_strm.JmpBuf()) == 0 )
+    for( i = 0; i < nrows; i++ )
     {
-        int sz = m_unGetsize;
-        memmove( current - sz, m_end - sz, sz );
-        while( current < end )
-        {
-            int val = m_low_strm.GetByte();
-            if( val != 0xff )
-            {
-                *current++ = (uchar)val;
-            }
-            else
-            {
-                val = m_low_strm.GetByte();
-                if( val == 0 )
-                    *current++ = 0xFF;
-                else if( !(0xD0 <= val && val <= 0xD7) )
-                {
-                    m_low_strm.SetPos( m_low_strm.GetPos() - 2 );
-                    goto fetch_end;
-                }
-            }
-        }
-    fetch_end: ;
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i*8));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(qt.tq_hi + i*8));
+        __m128i lo = _mm_loadu_si128((const __m128i*)(qt.tq_lo + i*8));
+        x[i] = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(c, hi), _mm_mulhi_epi16(c, lo)),
+                             _mm_srli_epi16(_mm_mullo_epi16(c, lo), 15));
     }
+
+    // columns, then rows; each output row of the scalar version is a vector
+    if( nrows == 8 )
+        idct1d_sse2( x );
     else
     {
-        if( current == m_start && m_jmp_set )
-            longjmp( m_jmp_buf, RBS_THROW_EOS );
+        // the low 4 columns of the 4 rows are nonzero, so are the first 4 vectors
+        idct1d_low_sse2( x );
     }
-    m_current = m_start;
-    m_end = m_start + (((current - m_start) + 3) & -4);
-    if( !bsIsBigEndian() )
-        bsBSwapBlock( m_start, m_end );
-}
+    transpose8x8_sse2( x );
+    idct1d_sse2( x );
 
+    __m128i delta = _mm_set1_epi16(4);
+    for( i = 0; i < 8; i++ )
+        _mm_storeu_si128((__m128i*)(dst + i*step), _mm_srai_epi16(_mm_add_epi16(x[i], delta), 3));
+}
 
-void  RJpegBitStream::Flush()
+static void aan_idct8x8_sse2( const short *src, const QuantTable& qt, short *dst, int step )
 {
-    m_end = m_start + m_block_size;
-    m_current = m_end - 4;
-    m_bit_idx = 0;
+    aan_idct8x8_rows_sse2( src, qt, dst, step, 8 );
 }
 
-void  RJpegBitStream::AlignOnByte()
+static void aan_idct8x8_low_sse2( const short *src, const QuantTable& qt, short *dst, int step )
 {
-    m_bit_idx &= -8;
+    aan_idct8x8_rows_sse2( src, qt, dst, step, 4 );
 }
 
-int  RJpegBitStream::FindMarker()
+#endif
+
+typedef void (*IDCTFunc)( const short *src, const QuantTable& qt, short *dst, int step );
+
+
+/////////////////////// MCU store functions //////////////////////
+
+// The IDCT output is 4x scaled and centered at 0:
+// a sample is converted to 8 bits as saturate(descale(v + 128*4, 2)).
+// Chroma samples are kept centered for the color conversion.
+
+// destination image: a single plane for packed formats,
+// Y, U, V (or Y and interleaved UV for NV12) planes for planar ones
+struct JpegOutput
 {
-    int code = m_low_strm.GetWord();
-    while( (code & 0xFF00) != 0xFF00 || (code == 0xFFFF || code == 0xFF00 ))
-    {
-        code = ((code&255) << 8) | m_low_strm.GetByte();
-    }
-    return code;
-}
+    int     colorspace;
+    int     width, height; // size of the luma plane
+    uchar*  plane[3];
+    int     step[3];
+};
 
 
-// IDCT without prescaling
-static void aan_idct8x8( int *src, int *dst, int step )
+static void initOutput( JpegOutput& out, uchar* data, int step,
+                        int width, int height, int colorspace )
 {
-    int   workspace[64], *work = workspace;
-    int   i;
+    out.colorspace = colorspace;
+    out.width = width;
+    out.height = height;
+    out.plane[0] = data;
+    out.plane[1] = out.plane[2] = 0;
+    out.step[0] = out.step[1] = out.step[2] = step;
 
-    /* Pass 1: process rows */
-    for( i = 8; i > 0; i--, src += 8, work += 8 )
+    if( colorspace == COLORSPACE_YUV444P )
     {
-        /* Odd part */
-        int  x0 = src[5], x1 = src[3];
-        int  x2 = src[1], x3 = src[7];
+        out.plane[1] = data + step*height;
+        out.plane[2] = data + step*height*2;
+    }
+    else if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+    {
+        // 4:2:0 planes cover the image rounded up to even size;
+        // the decoded MCUs always have the padding samples
+        out.width = (width + 1) & -2;
+        out.height = (height + 1) & -2;
+        out.plane[1] = data + step*out.height;
+        if( colorspace == COLORSPACE_I420 )
+        {
+            out.step[1] = out.step[2] = step/2;
+            out.plane[2] = out.plane[1] + (step/2)*(out.height/2);
+        }
+    }
+}
 
-        int  x4 = x0 + x1; x0 -= x1;
 
-        x1 = x2 + x3; x2 -= x3;
-        x3 = x1 + x4; x1 -= x4;
+static void storeSamples( const short* src, uchar* dst, int n )
+{
+    int x = 0;
+#ifdef WITH_SSE2
+    __m128i delta = _mm_set1_epi16(128*4 + 2);
+    for( ; x <= n - 8; x += 8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        v = _mm_srai_epi16(_mm_adds_epi16(v, delta), 2);
+        _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(v, v));
+    }
+#endif
+    for( ; x < n; x++ )
+    {
+        int val = descale( src[x] + 128*4, 2 );
+        dst[x] = saturate( val );
+    }
+}
 
-        x4 = (x0 + x2)*C1_847;
-        x0 = descale( x4 - x0*C2_613, fixb);
-        x2 = descale( x2*C1_082 - x4, fixb);
-        x1 = descale( x1*C1_414, fixb);
 
-        x0 -= x3;
-        x1 -= x0;
-        x2 += x1;
+// stores samples of the subsampled plane, repeating each of them (1 << x_shift) times.
+// phase is the position of the first output sample inside the group of the repeated ones
+static void storeSamplesUp( const short* src, uchar* dst, int n, int x_shift, int phase )
+{
+    int x = 0;
+    if( x_shift == 0 )
+    {
+        storeSamples( src, dst, n );
+        return;
+    }
+#ifdef WITH_SSE2
+    if( x_shift == 1 && phase == 0 )
+    {
+        __m128i delta = _mm_set1_epi16(128*4 + 2);
+        for( ; x <= n - 8; x += 8 )
+        {
+            __m128i v = _mm_loadl_epi64((const __m128i*)(src + (x >> 1)));
+            v = _mm_srai_epi16(_mm_adds_epi16(_mm_unpacklo_epi16(v, v), delta), 2);
+            _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(v, v));
+        }
+    }
+#endif
+    for( ; x < n; x++ )
+    {
+        int val = descale( src[(x + phase) >> x_shift] + 128*4, 2 );
+        dst[x] = saturate( val );
+    }
+}
 
-        work[7] = x3; work[6] = x0;
-        work[5] = x1; work[4] = x2;
 
-        /* Even part */
-        x2 = src[2]; x3 = src[6];
-        x0 = src[0]; x1 = src[4];
+#ifdef WITH_SSE2
 
-        x4 = x2 + x3;
-        x2 = descale((x2-x3)*C1_414, fixb) - x4;
+// stores 8 pixels given by the low halves of b, g and r as BGR (24 bytes) or BGRA (32 bytes)
+static inline void storePixels_sse2( __m128i b, __m128i g, __m128i r, uchar* dst, int dcn )
+{
+    if( dcn == 4 )
+    {
+        __m128i bg = _mm_unpacklo_epi8(b, g), ra = _mm_unpacklo_epi8(r, _mm_set1_epi8(-1));
+        _mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(bg, ra));
+        return;
+    }
 
-        x3 = x0 + x1; x0 -= x1;
-        x1 = x3 + x4; x3 -= x4;
-        x4 = x0 + x2; x0 -= x2;
+    // BGR0 pixels are packed to 6 bytes per 64-bit lane, then to 12 bytes per vector
+    __m128i bg = _mm_unpacklo_epi8(b, g), r0 = _mm_unpacklo_epi8(r, _mm_setzero_si128());
+    __m128i p0 = _mm_unpacklo_epi16(bg, r0), p1 = _mm_unpackhi_epi16(bg, r0);
+    __m128i m0 = _mm_set_epi32(0, 0xffffff, 0, 0xffffff);
+    __m128i m1 = _mm_set_epi32(0xffff, 0xff000000, 0xffff, 0xff000000);
+    __m128i mlo = _mm_set_epi32(0, 0, 0xffff, 0xffffffff);
 
-        x2 = work[7];
-        x1 -= x2; x2 = 2*x2 + x1;
-        work[7] = x1; work[0] = x2;
+    p0 = _mm_or_si128(_mm_and_si128(p0, m0), _mm_and_si128(_mm_srli_epi64(p0, 8), m1));
+    p1 = _mm_or_si128(_mm_and_si128(p1, m0), _mm_and_si128(_mm_srli_epi64(p1, 8), m1));
+    p0 = _mm_or_si128(_mm_and_si128(p0, mlo), _mm_srli_si128(_mm_andnot_si128(mlo, p0), 2));
+    p1 = _mm_or_si128(_mm_and_si128(p1, mlo), _mm_srli_si128(_mm_andnot_si128(mlo, p1), 2));
 
-        x2 = work[6];
-        x1 = x4 + x2; x4 -= x2;
-        work[1] = x1; work[6] = x4;
+    _mm_storeu_si128((__m128i*)dst, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+    _mm_storel_epi64((__m128i*)(dst + 16), _mm_srli_si128(p1, 4));
+}
 
-        x1 = work[5]; x2 = work[4];
-        x4 = x0 + x1; x0 -= x1;
-        x1 = x3 + x2; x3 -= x2;
+#endif
 
-        work[2] = x4; work[5] = x0;
-        work[3] = x3; work[4] = x1;
+// gray samples to BGR or BGRA pixels
+static void storeGrayPixels( const short* src, uchar* dst, int n, int dcn )
+{
+    int x = 0;
+#ifdef WITH_SSE2
+    __m128i delta = _mm_set1_epi16(128*4 + 2);
+    for( ; x <= n - 8; x += 8 )
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        v = _mm_srai_epi16(_mm_adds_epi16(v, delta), 2);
+        v = _mm_packus_epi16(v, v);
+        storePixels_sse2( v, v, v, dst + x*dcn, dcn );
+    }
+#endif
+    for( ; x < n; x++ )
+    {
+        int val = descale( src[x] + 128*4, 2 );
+        uchar* d = dst + x*dcn;
+        d[0] = d[1] = d[2] = saturate( val );
+        if( dcn == 4 )
+            d[3] = 255;
     }
+}
 
-    /* Pass 2: process columns */
-    work = workspace;
-    for( i = 8; i > 0; i--, dst += step, work++ )
+
+// YCbCr to BGR or BGRA. Chroma samples are repeated (1 << x_shift) times,
+// phase is as in storeSamplesUp. The SIMD version covers 4:4:4, 4:2:2 and 4:2:0
+// (x_shift <= 1) and gives the same results as the scalar one
+static void storeColorPixels( const short* Y, const short* Cb, const short* Cr,
+                              uchar* dst, int n, int x_shift, int phase, int dcn )
+{
+    int x = 0;
+#ifdef WITH_SSE2
+    if( x_shift <= 1 && phase == 0 )
     {
-        /* Odd part */
-        int  x0 = work[8*5], x1 = work[8*3];
-        int  x2 = work[8*1], x3 = work[8*7];
+        __m128i delta = _mm_set1_epi16(128*4), z = _mm_setzero_si128();
+        __m128i k_b = _mm_setr_epi16(1 << fixc, b_cb, 1 << fixc, b_cb, 1 << fixc, b_cb, 1 << fixc, b_cb);
+        __m128i k_r = _mm_setr_epi16(1 << fixc, r_cr, 1 << fixc, r_cr, 1 << fixc, r_cr, 1 << fixc, r_cr);
+        __m128i k_g = _mm_setr_epi16(g_cb, g_cr, g_cb, g_cr, g_cb, g_cr, g_cb, g_cr);
 
-        int  x4 = x0 + x1; x0 -= x1;
-        x1 = x2 + x3; x2 -= x3;
-        x3 = x1 + x4; x1 -= x4;
+        for( ; x <= n - 8; x += 8 )
+        {
+            __m128i y = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(Y + x)), delta);
+            __m128i cb, cr;
+            if( x_shift == 0 )
+            {
+                cb = _mm_loadu_si128((const __m128i*)(Cb + x));
+                cr = _mm_loadu_si128((const __m128i*)(Cr + x));
+            }
+            else
+            {
+                cb = _mm_loadl_epi64((const __m128i*)(Cb + (x >> 1)));
+                cr = _mm_loadl_epi64((const __m128i*)(Cr + (x >> 1)));
+                cb = _mm_unpacklo_epi16(cb, cb);
+                cr = _mm_unpacklo_epi16(cr, cr);
+            }
 
-        x4 = (x0 + x2)*C1_847;
-        x0 = descale( x4 - x0*C2_613, fixb);
-        x2 = descale( x2*C1_082 - x4, fixb);
-        x1 = descale( x1*C1_414, fixb);
+            __m128i b0 = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, cb), k_b), fixc + 2);
+            __m128i b1 = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, cb), k_b), fixc + 2);
+            __m128i r0 = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, cr), k_r), fixc + 2);
+            __m128i r1 = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, cr), k_r), fixc + 2);
+            __m128i g0 = _mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(z, y), 16 - fixc),
+                                       _mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), k_g));
+            __m128i g1 = _mm_add_epi32(_mm_srai_epi32(_mm_unpackhi_epi16(z, y), 16 - fixc),
+                                       _mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), k_g));
+            g0 = _mm_srai_epi32(g0, fixc + 2);
+            g1 = _mm_srai_epi32(g1, fixc + 2);
+
+            __m128i b = _mm_packs_epi32(b0, b1), g = _mm_packs_epi32(g0, g1), r = _mm_packs_epi32(r0, r1);
+            b = _mm_packus_epi16(b, b);
+            g = _mm_packus_epi16(g, g);
+            r = _mm_packus_epi16(r, r);
+            storePixels_sse2( b, g, r, dst + x*dcn, dcn );
+        }
+    }
+#endif
+    for( ; x < n; x++ )
+    {
+        int  Y0 = (Y[x] + 128*4) << fixc;
+        int  cb = Cb[(x + phase) >> x_shift];
+        int  cr = Cr[(x + phase) >> x_shift];
+        uchar* d = dst + x*dcn;
+        int t = (Y0 + cb*b_cb) >> (fixc + 2);
+        d[0] = saturate(t);
+        t = (Y0 + cb*g_cb + cr*g_cr) >> (fixc + 2);
+        d[1] = saturate(t);
+        t = (Y0 + cr*r_cr) >> (fixc + 2);
+        d[2] = saturate(t);
+        if( dcn == 4 )
+            d[3] = 255;
+    }
+}
 
-        x0 -= x3;
-        x1 -= x0;
-        x2 += x1;
 
-        dst[7] = x3; dst[6] = x0;
-        dst[5] = x1; dst[4] = x2;
+// interleaves 4:2:0 chroma samples into the NV12 UV plane
+static void storeInterleavedUV( const short* Cb, const short* Cr, uchar* dst, int n )
+{
+    int x = 0;
+#ifdef WITH_SSE2
+    __m128i delta = _mm_set1_epi16(128*4 + 2);
+    for( ; x <= n - 8; x += 8 )
+    {
+        __m128i u = _mm_loadu_si128((const __m128i*)(Cb + x));
+        __m128i v = _mm_loadu_si128((const __m128i*)(Cr + x));
+        u = _mm_srai_epi16(_mm_adds_epi16(u, delta), 2);
+        v = _mm_srai_epi16(_mm_adds_epi16(v, delta), 2);
+        u = _mm_packus_epi16(u, u);
+        v = _mm_packus_epi16(v, v);
+        _mm_storeu_si128((__m128i*)(dst + x*2), _mm_unpacklo_epi8(u, v));
+    }
+#endif
+    for( ; x < n; x++ )
+    {
+        int u = descale( Cb[x] + 128*4, 2 );
+        int v = descale( Cr[x] + 128*4, 2 );
+        dst[x*2] = saturate( u );
+        dst[x*2 + 1] = saturate( v );
+    }
+}
 
-        /* Even part */
-        x2 = work[8*2]; x3 = work[8*6];
-        x0 = work[8*0]; x1 = work[8*4];
 
-        x4 = x2 + x3;
-        x2 = descale((x2-x3)*C1_414, fixb) - x4;
+// stores a decoded MCU. Y is the luma plane of the MCU, Cb and Cr are the chroma planes
+// (or 0 if the image is gray or chroma was not decoded), subsampled by (1 << x_shift, 1 << y_shift).
+// The part of the MCU starting at (sx, sy) and of size (x2, y2) is stored at (x1, y1) of the output.
+static void storeMCU( const JpegOutput& out, const short* Y, int ystep,
+                      const short* Cb, const short* Cr, int cstep, int x_shift, int y_shift,
+                      int sx, int sy, int x1, int y1, int x2, int y2 )
+{
+    int  x, y;
+    int  colorspace = out.colorspace;
+    int  phase = sx & ((1 << x_shift) - 1);
 
-        x3 = x0 + x1; x0 -= x1;
-        x1 = x3 + x4; x3 -= x4;
-        x4 = x0 + x2; x0 -= x2;
+    Y += ystep*sy + sx;
+    if( Cb )
+    {
+        Cb += sx >> x_shift;
+        Cr += sx >> x_shift;
+    }
 
-        x2 = dst[7];
-        x1 -= x2; x2 = 2*x2 + x1;
-        x1 = descale(x1,3);
-        x2 = descale(x2,3);
+    if( colorspace == COLORSPACE_BGR || colorspace == COLORSPACE_BGRA )
+    {
+        int dcn = colorspace == COLORSPACE_BGR ? 3 : 4;
+        uchar* dst = out.plane[0] + out.step[0]*y1 + x1*dcn;
 
-        dst[7] = x1; dst[0] = x2;
+        for( y = 0; y < y2; y++, dst += out.step[0], Y += ystep )
+        {
+            if( Cb )
+            {
+                int shift = cstep*((y + sy) >> y_shift);
+                storeColorPixels( Y, Cb + shift, Cr + shift, dst, x2, x_shift, phase, dcn );
+            }
+            else
+                storeGrayPixels( Y, dst, x2, dcn );
+        }
+        return;
+    }
 
-        x2 = dst[6];
-        x1 = descale(x4 + x2,3);
-        x4 = descale(x4 - x2,3);
-        dst[1] = x1; dst[6] = x4;
+    // luma plane
+    {
+        uchar* dst = out.plane[0] + out.step[0]*y1 + x1;
+        const short* src = Y;
+        for( y = 0; y < y2; y++, dst += out.step[0], src += ystep )
+            storeSamples( src, dst, x2 );
+    }
 
-        x1 = dst[5]; x2 = dst[4];
+    if( colorspace == COLORSPACE_YUV444P )
+    {
+        for( int k = 1; k <= 2; k++ )
+        {
+            uchar* dst = out.plane[k] + out.step[k]*y1 + x1;
+            const short* src = k == 1 ? Cb : Cr;
+            for( y = 0; y < y2; y++, dst += out.step[k] )
+            {
+                if( src )
+                    storeSamplesUp( src + cstep*((y + sy) >> y_shift), dst, x2, x_shift, phase );
+                else
+                    memset( dst, 128, x2 );
+            }
+        }
+    }
+    else if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+    {
+        int  cx1 = x1 >> 1, cy1 = y1 >> 1;
+        int  cw = (x2 + 1) >> 1, ch = (y2 + 1) >> 1;
+        bool nv12 = colorspace == COLORSPACE_NV12;
+        uchar* dst0 = out.plane[1] + out.step[1]*cy1 + cx1*(nv12 ? 2 : 1);
+        uchar* dst1 = nv12 ? dst0 + 1 : out.plane[2] + out.step[2]*cy1 + cx1;
+        int  dcn = nv12 ? 2 : 1;
 
-        x4 = descale(x0 + x1,3);
-        x0 = descale(x0 - x1,3);
-        x1 = descale(x3 + x2,3);
-        x3 = descale(x3 - x2,3);
+        // single-sample MCUs (1/8 scale, no subsampling): the even one
+        // provides the chroma of the 2x2 group alone.
+        // Otherwise x1, y1 are even and so are sx, sy
+        if( (x1 | y1) & 1 )
+            return;
 
-        dst[2] = x4; dst[5] = x0;
-        dst[3] = x3; dst[4] = x1;
+        for( y = 0; y < ch; y++, dst0 += out.step[1], dst1 += out.step[nv12 ? 1 : 2] )
+        {
+            if( !Cb )
+            {
+                for( x = 0; x < cw; x++ )
+                    dst0[x*dcn] = dst1[x*dcn] = 128;
+            }
+            else if( x_shift == 1 && y_shift == 1 )
+            {
+                // native 4:2:0, no resampling
+                const short* cb = Cb + cstep*(y + (sy >> 1));
+                const short* cr = Cr + cstep*(y + (sy >> 1));
+                if( nv12 )
+                    storeInterleavedUV( cb, cr, dst0, cw );
+                else
+                {
+                    storeSamples( cb, dst0, cw );
+                    storeSamples( cr, dst1, cw );
+                }
+            }
+            else
+            {
+                // average the chroma of 2x2 luma samples
+                int ya = (y*2 + sy) >> y_shift, yb = (std::min(y*2 + 1, y2 - 1) + sy) >> y_shift;
+                const short* cb0 = Cb + cstep*ya;
+                const short* cb1 = Cb + cstep*yb;
+                const short* cr0 = Cr + cstep*ya;
+                const short* cr1 = Cr + cstep*yb;
+
+                for( x = 0; x < cw; x++ )
+                {
+                    int xa = (x*2 + phase) >> x_shift, xb = (std::min(x*2 + 1, x2 - 1) + phase) >> x_shift;
+                    int u = descale( cb0[xa] + cb0[xb] + cb1[xa] + cb1[xb] + 128*16, 4 );
+                    int v = descale( cr0[xa] + cr0[xb] + cr1[xa] + cr1[xb] + 128*16, 4 );
+                    dst0[x*dcn] = saturate( u );
+                    dst1[x*dcn] = saturate( v );
+                }
+            }
+        }
     }
 }
 
 
 static const int max_dec_htable_size = 1 << 12;
 static const int first_table_bits = 9;
+static const int fast_table_bits = 10;
+
+// the standard Huffman tables (K.3), used when an image does not define its own
+// (e.g. MJPEG frames of AVI1 format): DC luma, DC chroma, AC luma, AC chroma
+static const uchar* const default_htables[] = { jpegTableK3, jpegTableK4, jpegTableK5, jpegTableK6 };
+
+// the decoding tables built from default_htables
+struct DefaultHuffmanTables
+{
+    short table[4][max_dec_htable_size];
+    int   fast[4][1 << fast_table_bits];
+
+    DefaultHuffmanTables()
+    {
+        int buffer[1024];
+        for( int i = 0; i < 4; i++ )
+        {
+            bsCreateDecodeHuffmanTable( bsCreateSourceHuffmanTable(
+                default_htables[i], buffer, 16, first_table_bits ), table[i], max_dec_htable_size );
+            bsCreateFastHuffmanTable( default_htables[i], fast[i], 16, fast_table_bits );
+        }
+    }
+};
+
+static const DefaultHuffmanTables default_huffman_tables;
 
 GrFmtJpegReader::GrFmtJpegReader( const char* filename )
 {
     m_filename = filename;
     m_planes= -1;
     m_offset= -1;
+    m_parallel = false;
+    memset( m_tq_src_size, 0, sizeof(m_tq_src_size) );
+    memset( m_td_src_size, 0, sizeof(m_td_src_size) );
+    memset( m_ta_src_size, 0, sizeof(m_ta_src_size) );
 
     int i;
     for( i = 0; i < 4; i++ )
     {
         m_td[i] = new short[max_dec_htable_size];
         m_ta[i] = new short[max_dec_htable_size];
+        m_td_fast[i] = new int[1 << fast_table_bits];
+        m_ta_fast[i] = new int[1 << fast_table_bits];
     }
 }
 
@@ -1785,40 +2072,104 @@ GrFmtJpegReader::~GrFmtJpegReader()
         m_td[i] = 0;
         delete[] m_ta[i];
         m_ta[i] = 0;
+        delete[] m_td_fast[i];
+        m_td_fast[i] = 0;
+        delete[] m_ta_fast[i];
+        m_ta_fast[i] = 0;
     }
 }
 
 
 void  GrFmtJpegReader::Close()
 {
-    m_strm.Close();
+    std::vector<uchar>().swap( m_buf );
+    m_low_strm.Init( 0, 0 );
+    m_strm.Init( 0 );
+}
+
+
+// reads the whole file and terminates it by EOI, so that the entropy decoder
+// does not need the bounds checks
+bool  GrFmtJpegReader::LoadFile( const char* filename )
+{
+    Close();
+
+    FILE* f = fopen( filename, "rb" );
+    if( !f )
+        return false;
+
+    fseek( f, 0, SEEK_END );
+    long size = ftell( f );
+    fseek( f, 0, SEEK_SET );
+
+    bool ok = size > 0;
+    if( ok )
+    {
+        m_buf.resize( size + 2 );
+        ok = fread( &m_buf[0], 1, size, f ) == (size_t)size;
+        m_buf[size] = 0xFF;
+        m_buf[size + 1] = 0xD9;
+        m_low_strm.Init( &m_buf[0], &m_buf[0] + size );
+    }
+    fclose( f );
+    if( !ok )
+        Close();
+    return ok;
 }
 
 
 bool GrFmtJpegReader::ReadHeader()
+{
+    assert( m_filename && strlen(m_filename) != 0 );
+    return LoadFile( m_filename ) && ParseHeader();
+}
+
+
+bool GrFmtJpegReader::ReadHeader( const uchar* data, size_t size )
+{
+    if( !data || size < 4 || size > INT_MAX - 2 )
+        return false;
+
+    // the entropy decoder reads up to a marker without the bounds checks, so the data
+    // not ending with EOI (possibly followed by zeros) is copied and terminated
+    size_t end = size;
+    while( end > 2 && data[end - 1] == 0 )
+        end--;
+    if( data[end - 2] != 0xFF || data[end - 1] != 0xD9 )
+    {
+        m_buf.resize( size + 2 );
+        memcpy( &m_buf[0], data, size );
+        m_buf[size] = 0xFF;
+        m_buf[size + 1] = 0xD9;
+        data = &m_buf[0];
+    }
+    m_low_strm.Init( data, data + size );
+    return ParseHeader();
+}
+
+
+bool GrFmtJpegReader::ParseHeader()
 {
     char buffer[16];
     int  i;
     bool result = false, is_sof = false,
-    is_qt = false, is_ht = false, is_sos = false;
-
-    assert( strlen(m_filename) != 0 );
-    if( !m_strm.Open( m_filename )) return false;
+    is_qt = false, is_sos = false;
 
     memset( m_is_tq, 0, sizeof(m_is_tq));
     memset( m_is_td, 0, sizeof(m_is_td));
     memset( m_is_ta, 0, sizeof(m_is_ta));
     m_MCUs = 0;
 
-    if( setjmp( m_strm.JmpBuf()) == 0 )
     {
-        RMByteStream& lstrm = m_strm.m_low_strm;
+        JpegByteReader& lstrm = m_low_strm;
 
         lstrm.Skip( 2 ); // skip SOI marker
 
         for(;;)
         {
-            int marker = m_strm.FindMarker() & 255;
+            int marker = lstrm.FindMarker();
+            if( marker < 0 ) goto parsing_end;
+            marker &= 255;
 
             // check for standalone markers
             if( marker != 0xD8 /* SOI */ && marker != 0xD9 /* EOI */ &&
@@ -1839,13 +2190,16 @@ bool GrFmtJpegReader::ReadHeader()
                         break;
 
                     case 0xC0: // SOF0
+                    case 0xC1: // SOF1, extended sequential
+                    case 0xC2: // SOF2, progressive
                         m_precision = lstrm.GetByte();
                         m_height = lstrm.GetWord();
                         m_width = lstrm.GetWord();
                         m_planes = lstrm.GetByte();
 
                         if( m_width == 0 || m_height == 0 || // DNL not supported
-                           (m_planes != 1 && m_planes != 3)) goto parsing_end;
+                           (m_planes != 1 && m_planes != 3) ||
+                           m_precision != 8 ) goto parsing_end; // 12-bit samples not supported
 
                         m_iscolor = m_planes == 3;
 
@@ -1887,7 +2241,6 @@ bool GrFmtJpegReader::ReadHeader()
 
                     case 0xC4: // DHT
                         if( !LoadHuffmanTables( length )) goto parsing_end;
-                        is_ht = true;
                         break;
 
                     case 0xDA: // SOS
@@ -1905,12 +2258,14 @@ bool GrFmtJpegReader::ReadHeader()
     parsing_end: ;
     }
 
-    result = /*is_jfif &&*/ is_sof && is_qt && is_ht && is_sos;
-    if( !result )
+    result = /*is_jfif &&*/ is_sof && is_qt && is_sos;
+    if( result )
+        LoadDefaultHuffmanTables();
+    else
     {
         m_width = m_height = -1;
         m_offset = -1;
-        m_strm.Close();
+        Close();
     }
     return result;
 }
@@ -1921,7 +2276,7 @@ bool GrFmtJpegReader::LoadQuantTables( int length )
     uchar buffer[128];
     int  i, tq_size;
 
-    RMByteStream& lstrm = m_strm.m_low_strm;
+    JpegByteReader& lstrm = m_low_strm;
     length -= 2;
 
     while( length > 0 )
@@ -1935,13 +2290,24 @@ bool GrFmtJpegReader::LoadQuantTables( int length )
         length -= tq_size;
 
         lstrm.GetBytes( buffer, tq_size - 1 );
+        if( lstrm.IsEOS() ) return false;
+
+        if( m_tq_src_size[tq] == tq_size - 1 &&
+            memcmp( m_tq_src[tq], buffer, tq_size - 1 ) == 0 )
+        {
+            m_is_tq[tq] = true;
+            continue;
+        }
+        memcpy( m_tq_src[tq], buffer, tq_size - 1 );
+        m_tq_src_size[tq] = tq_size - 1;
 
         if( size == 0 ) // 8 bit quant factors
         {
             for( i = 0; i < 64; i++ )
             {
                 int idx = zigzag[i];
-                m_tq[tq][idx] = buffer[i] * 16 * idct_prescale[idx];
+                m_tq[tq].tq[idx] = buffer[i] * 16 * idct_prescale[idx];
+                m_tq[tq].q[idx] = buffer[i];
             }
         }
         else // 16 bit quant factors
@@ -1949,9 +2315,17 @@ bool GrFmtJpegReader::LoadQuantTables( int length )
             for( i = 0; i < 64; i++ )
             {
                 int idx = zigzag[i];
-                m_tq[tq][idx] = ((unsigned short*)buffer)[i] * idct_prescale[idx];
+                m_tq[tq].tq[idx] = ((unsigned short*)buffer)[i] * idct_prescale[idx];
+                m_tq[tq].q[idx] = (ushort)(buffer[i*2]*256 + buffer[i*2 + 1]);
             }
         }
+
+        for( i = 0; i < 64; i++ )
+        {
+            int hi = (m_tq[tq].tq[i] + 32768) >> 16;
+            m_tq[tq].tq_hi[i] = (short)hi;
+            m_tq[tq].tq_lo[i] = (short)(m_tq[tq].tq[i] - hi*65536);
+        }
         m_is_tq[tq] = true;
     }
 
@@ -1966,7 +2340,7 @@ bool GrFmtJpegReader::LoadHuffmanTables( int length )
     int  buffer2[1024];
 
     int  i, ht_size;
-    RMByteStream& lstrm = m_strm.m_low_strm;
+    JpegByteReader& lstrm = m_low_strm;
     length -= 2;
 
     while( length > 0 )
@@ -1981,40 +2355,91 @@ bool GrFmtJpegReader::LoadHuffmanTables( int length )
         lstrm.GetBytes( buffer, max_bits );
         for( i = 0, ht_size = 0; i < max_bits; i++ ) ht_size += buffer[i];
 
-        if( length < ht_size ) return false;
+        if( length < ht_size || ht_size > 256 ) return false;
         length -= ht_size;
 
         lstrm.GetBytes( buffer + max_bits, ht_size );
+        if( lstrm.IsEOS() ) return false;
+
+        uchar* src = hclass == 0 ? m_td_src[t] : m_ta_src[t];
+        int&   src_size = hclass == 0 ? m_td_src_size[t] : m_ta_src_size[t];
 
-        if( !bsCreateDecodeHuffmanTable(bsCreateSourceHuffmanTable(
-                    buffer, buffer2, max_bits, first_table_bits ),
-                    hclass == 0 ? m_td[t] : m_ta[t],
-                    max_dec_htable_size )) return false;
+        if( src_size != max_bits + ht_size || memcmp( src, buffer, src_size ) != 0 )
+        {
+            src_size = 0;
+            if( !bsCheckHuffmanTable( buffer, max_bits ) ||
+                !bsCreateDecodeHuffmanTable(bsCreateSourceHuffmanTable(
+                        buffer, buffer2, max_bits, first_table_bits ),
+                        hclass == 0 ? m_td[t] : m_ta[t],
+                        max_dec_htable_size )) return false;
+            bsCreateFastHuffmanTable( buffer, hclass == 0 ? m_td_fast[t] : m_ta_fast[t],
+                                      max_bits, fast_table_bits );
+            memcpy( src, buffer, max_bits + ht_size );
+            src_size = max_bits + ht_size;
+        }
         if( hclass == 0 )
             m_is_td[t] = true;
         else
             m_is_ta[t] = true;
     }
-    return true;
+    return true;
+}
+
+
+void GrFmtJpegReader::LoadDefaultHuffmanTables()
+{
+    // slots 0 and 1 (luma and chroma) not defined by the image get the standard tables
+    for( int i = 0; i < 4; i++ )
+    {
+        int t = i & 1, hclass = i >> 1;
+        bool& is_table = hclass == 0 ? m_is_td[t] : m_is_ta[t];
+        if( is_table )
+            continue;
+
+        const uchar* htable = default_htables[i];
+        int j, size = 16;
+        for( j = 0; j < 16; j++ ) size += htable[j];
+
+        uchar* src = hclass == 0 ? m_td_src[t] : m_ta_src[t];
+        int&   src_size = hclass == 0 ? m_td_src_size[t] : m_ta_src_size[t];
+
+        if( src_size != size || memcmp( src, htable, size ) != 0 )
+        {
+            memcpy( hclass == 0 ? m_td[t] : m_ta[t], default_huffman_tables.table[i],
+                    sizeof(default_huffman_tables.table[i]) );
+            memcpy( hclass == 0 ? m_td_fast[t] : m_ta_fast[t], default_huffman_tables.fast[i],
+                    sizeof(default_huffman_tables.fast[i]) );
+            memcpy( src, htable, size );
+            src_size = size;
+        }
+        is_table = true;
+    }
 }
 
 
-bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
+bool GrFmtJpegReader::ReadData( uchar* data, int step, int colorspace, int scale, Rect roi )
 {
-    if( m_offset < 0 || !m_strm.IsOpened())
+    bool result = false, complete = false;
+    bool progressive = m_type == 2, has_coeffs = false;
+
+    if( m_offset < 0 )
         return false;
 
-    if( setjmp( m_strm.JmpBuf()) == 0 )
     {
-        RMByteStream& lstrm = m_strm.m_low_strm;
+        JpegByteReader& lstrm = m_low_strm;
         lstrm.SetPos( m_offset );
 
         for(;;)
         {
-            int marker = m_strm.FindMarker() & 255;
+            int marker = lstrm.FindMarker();
+            if( marker < 0 ) goto decoding_end;
+            marker &= 255;
 
             if( marker == 0xD8 /* SOI */ || marker == 0xD9 /* EOI */ )
+            {
+                complete = marker == 0xD9;
                 goto decoding_end;
+            }
 
             // check for standalone markers
             if( marker != 0x01 /* TEM */ && !( 0xD0 <= marker && marker <= 0xD7 ))
@@ -2028,6 +2453,10 @@ bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
                         if( !LoadHuffmanTables( length )) goto decoding_end;
                         break;
 
+                    case 0xDB: // DQT
+                        if( !LoadQuantTables( length )) goto decoding_end;
+                        break;
+
                     case 0xDA: // SOS
                                // read scan header
                     {
@@ -2035,7 +2464,9 @@ bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
                         int i, ns = lstrm.GetByte();
                         int sum = 0, a; // spectral selection & approximation
 
-                        if( ns != m_planes ) goto decoding_end;
+                        // progressive scans may cover a part of the components
+                        if( progressive ? ns < 1 || ns > m_planes : ns != m_planes )
+                            goto decoding_end;
                         for( i = 0; i < ns; i++ )
                         {
                             int td, ta, c = lstrm.GetByte() - 1;
@@ -2049,9 +2480,7 @@ bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
                             td = lstrm.GetByte();
                             ta = td & 15;
                             td >>= 4;
-                            if( !(ta <= 3 && m_is_ta[ta] &&
-                                  td <= 3 && m_is_td[td] &&
-                                  m_is_tq[m_ci[c].tq]) )
+                            if( !(ta <= 3 && td <= 3 && m_is_tq[(int)m_ci[c].tq]) )
                                 goto decoding_end;
 
                             m_ci[c].td = (char)td;
@@ -2069,8 +2498,43 @@ bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
                         m_al = a & 15;
                         m_ah = a >> 4;
 
-                        ProcessScan( idx, ns, data, step, color );
-                        goto decoding_end; // only single scan case is supported now
+                        if( lstrm.IsEOS() ) goto decoding_end;
+
+                        // the tables used by the scan
+                        for( i = 0; i < ns; i++ )
+                        {
+                            int c = idx[i];
+                            if( (m_ss == 0 && m_ah == 0 && !m_is_td[(int)m_ci[c].td]) ||
+                                (m_se > 0 && !m_is_ta[(int)m_ci[c].ta]) )
+                                goto decoding_end;
+                        }
+
+                        if( !progressive )
+                        {
+                            // a single sequential scan
+                            if( m_ss != 0 || m_se != 63 || m_ah != 0 || m_al != 0 )
+                                goto decoding_end;
+                            if( data )
+                                result = ProcessScan( idx, ns, data, step, colorspace, scale, roi );
+                            else
+                            {
+                                AllocCoefficients();
+                                result = ProcessCoefficientScan( idx, ns );
+                            }
+                            goto decoding_end;
+                        }
+
+                        // DC scans may be interleaved, AC scans are of a single component
+                        if( m_se < m_ss || m_se > 63 || (m_ss == 0 ? m_se != 0 : ns != 1) || m_al > 13 )
+                            goto decoding_end;
+                        if( !has_coeffs )
+                        {
+                            AllocCoefficients();
+                            has_coeffs = true;
+                        }
+                        if( !ProcessCoefficientScan( idx, ns ))
+                            goto decoding_end;
+                        continue; // the stream is at the end of the scan
                     }
 
                         //m_offset = pos - 2;
@@ -2087,223 +2551,641 @@ bool GrFmtJpegReader::ReadData( uchar* data, int step, int color )
     decoding_end: ;
     }
 
-    return true;
+    // a progressive image is output when all its scans are read, or what is read if the data ended
+    if( has_coeffs )
+        result = (!data || StoreCoefficients( data, step, colorspace, scale, roi )) && complete;
+
+    return result;
+}
+
+
+// the layout of a scan and its output, shared by the threads decoding the restart intervals
+struct JpegScan
+{
+    int   idx[3], ns;
+    int   pos[3], h[3], v[3], bs[3];
+    // the IDCTs of each component for the blocks having DC only,
+    // the nonzero coefficients in the 4x4 corner and any blocks
+    IDCTFunc idct[3][3];
+    int   x_shift, y_shift;
+    bool  decode_chroma;
+    JpegOutput out;
+    int   width, height, mcu_cols;
+    int   mcu_end; // the MCUs from this one on are below the roi
+    Rect  roi; // the decoded part of the downscaled image
+    int   rx2, ry2; // the bottom right corner of the output, which may be wider than roi
+    // decoded coefficients of a progressive image (0 if the scan is sequential)
+    const short* coeffs[3];
+    int   coeff_step[3]; // blocks per row
+};
+
+
+// decodes a range of the restart intervals of a scan, each one from its own start
+class RestartIntervalBody : public ParallelLoopBody
+{
+public:
+    RestartIntervalBody( const GrFmtJpegReader& reader, const JpegScan& scan, const uchar* const* starts,
+                         int interval, int mcu1, int mcu2, volatile bool& ok )
+        : m_reader(reader), m_scan(scan), m_starts(starts),
+          m_interval(interval), m_mcu1(mcu1), m_mcu2(mcu2), m_ok(ok) {}
+
+    void operator()( const Range& range ) const
+    {
+        for( int i = range.start; i < range.end; i++ )
+        {
+            JpegBitReader strm;
+            int mcu = m_mcu1 + i*m_interval;
+
+            strm.Init( m_starts[i] );
+            if( !m_reader.DecodeMCUs( m_scan, strm, mcu, std::min( mcu + m_interval, m_mcu2 )))
+                m_ok = false;
+        }
+    }
+
+protected:
+    const GrFmtJpegReader& m_reader;
+    const JpegScan& m_scan;
+    const uchar* const* m_starts;
+    int   m_interval, m_mcu1, m_mcu2;
+    volatile bool& m_ok;
+};
+
+
+// sets the layout of the MCUs of all the components and the output
+void  GrFmtJpegReader::InitScan( JpegScan& sc, uchar* data, int step, int colorspace, int scale, Rect roi ) const
+{
+    IDCTFunc idct_tab[] = { aan_idct8x8, idct4x4, idct2x2, idct1x1 };
+    IDCTFunc idct_low = aan_idct8x8_low;
+    int   i, s = 0, ns = m_planes;
+    // downscaled blocks are bs x bs; the output has the size of the image divided by scale, rounded up
+    int   scale_idx = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+    int   width = (m_width + (1 << scale_idx) - 1) >> scale_idx;
+    int   height = (m_height + (1 << scale_idx) - 1) >> scale_idx;
+
+    assert( 1 << scale_idx == scale );
+
+#ifdef WITH_SSE2
+    if( checkHardwareSupport( CV_CPU_SSE2 ))
+    {
+        idct_tab[0] = aan_idct8x8_sse2;
+        idct_low = aan_idct8x8_low_sse2;
+    }
+#endif
+
+    if( roi.area() == 0 )
+        roi = Rect( 0, 0, width, height );
+    assert( 0 <= roi.x && roi.x + roi.width <= width &&
+            0 <= roi.y && roi.y + roi.height <= height );
+
+    initOutput( sc.out, data, step, roi.width, roi.height, colorspace );
+
+    sc.ns = ns;
+    // gray output needs luma only, so the chroma blocks are just skipped
+    sc.decode_chroma = ns == 3 && colorspace != COLORSPACE_GRAY;
+    for( i = 0; i < ns; i++ )
+    {
+        int c = sc.idx[i] = i;
+        // subsampled components of the downscaled image are decoded with larger blocks
+        // (up to the full 8x8), so that they keep the luma resolution where possible
+        int r = std::min( m_ci[0].h/m_ci[c].h, m_ci[0].v/m_ci[c].v );
+        int cscale_idx = std::max( scale_idx - (r == 4 ? 2 : r == 2 ? 1 : 0), 0 );
+        sc.bs[c] = 8 >> cscale_idx;
+        // the reduced IDCTs are cheap enough for any blocks
+        sc.idct[c][0] = cscale_idx == 0 ? idct8x8_dc : idct_tab[cscale_idx];
+        sc.idct[c][1] = cscale_idx == 0 ? idct_low : idct_tab[cscale_idx];
+        sc.idct[c][2] = idct_tab[cscale_idx];
+        sc.h[c] = m_ci[c].h*sc.bs[c];
+        sc.v[c] = m_ci[c].v*sc.bs[c];
+        sc.pos[c] = s >> 6; // the planes are placed as for the full-size blocks
+        s += m_ci[c].h*m_ci[c].v*64;
+        sc.coeffs[c] = 0;
+        sc.coeff_step[c] = 0;
+    }
+
+    sc.x_shift = sc.y_shift = 0;
+    if( ns == 3 )
+    {
+        sc.x_shift = sc.h[0]/(sc.h[1]*2);
+        sc.y_shift = sc.v[0]/(sc.v[1]*2);
+    }
+
+    sc.width = width;
+    sc.height = height;
+    sc.mcu_cols = (width + sc.h[0] - 1)/sc.h[0];
+    sc.roi = roi;
+    // the output may be wider than roi (4:2:0 formats)
+    sc.rx2 = roi.x + sc.out.width;
+    sc.ry2 = roi.y + sc.out.height;
+    sc.mcu_end = std::min( (sc.ry2 + sc.v[0] - 1)/sc.v[0], (height + sc.v[0] - 1)/sc.v[0] )*sc.mcu_cols;
 }
 
 
-void  GrFmtJpegReader::ResetDecoder()
+// fills the output samples that are not covered by the MCUs
+static void padOutput( const JpegScan& sc )
 {
-    m_ci[0].dc_pred = m_ci[1].dc_pred = m_ci[2].dc_pred = 0;
+    // 4:2:0 output of a 1/8 scaled image with 1x1 MCUs has no padding samples
+    const JpegOutput& out = sc.out;
+    if( sc.rx2 > sc.width )
+        for( int y = 0; y < std::min( out.height, sc.height - sc.roi.y ); y++ )
+        {
+            uchar* row = out.plane[0] + out.step[0]*y + sc.width - sc.roi.x;
+            row[0] = row[-1];
+        }
+    if( sc.ry2 > sc.height )
+        memcpy( out.plane[0] + out.step[0]*(sc.height - sc.roi.y),
+                out.plane[0] + out.step[0]*(sc.height - sc.roi.y - 1), out.width );
 }
 
-void  GrFmtJpegReader::ProcessScan( int* idx, int ns, uchar* data, int step, int color )
+
+bool  GrFmtJpegReader::ProcessScan( int* idx, int ns, uchar* data, int step, int colorspace, int scale, Rect roi )
 {
-    int   i, s = 0, mcu, x1 = 0, y1 = 0;
-    int   temp[64];
-    int   blocks[10][64];
-    int   pos[3], h[3], v[3];
-    int   x_shift = 0, y_shift = 0;
-    int   nch = color ? 3 : 1;
+    JpegScan sc;
 
     assert( ns == m_planes && m_ss == 0 && m_se == 63 &&
            m_al == 0 && m_ah == 0 ); // sequental & single scan
 
     assert( idx[0] == 0 && (ns ==1 || (idx[1] == 1 && idx[2] == 2)));
 
-    for( i = 0; i < ns; i++ )
-    {
-        int c = idx[i];
-        h[c] = m_ci[c].h*8;
-        v[c] = m_ci[c].v*8;
-        pos[c] = s >> 6;
-        s += h[c]*v[c];
-    }
+    InitScan( sc, data, step, colorspace, scale, roi );
+    roi = sc.roi;
 
-    if( ns == 3 )
+    int  mcu1 = 0, mcu2 = sc.mcu_end;
+    bool parallel = false, ok = true;
+
+    m_strm.Init( m_low_strm.GetPtr() );
+    if( m_MCUs > 0 )
     {
-        x_shift = h[0]/(h[1]*2);
-        y_shift = v[0]/(v[1]*2);
+        // restart intervals that end before the roi are skipped without decoding
+        int  skip = ((roi.y/sc.v[0])*sc.mcu_cols + roi.x/sc.h[0])/m_MCUs;
+
+        if( skip > 0 && !m_strm.SkipRestartIntervals( skip ))
+            return false;
+        mcu1 = skip*m_MCUs;
+
+        // the intervals are found by their markers and decoded concurrently;
+        // if some markers are missing, the scan is decoded as usual
+        int  count = (mcu2 - mcu1 + m_MCUs - 1)/m_MCUs;
+        if( m_parallel && count > 1 && m_strm.FindRestartIntervals( count, m_starts ))
+        {
+            volatile bool parallel_ok = true;
+            parallel_for_( Range( 0, count ),
+                           RestartIntervalBody( *this, sc, &m_starts[0], m_MCUs, mcu1, mcu2, parallel_ok ),
+                           std::min( count, getNumThreads()*4 ));
+            parallel = true;
+            ok = parallel_ok;
+        }
     }
 
-    m_strm.Flush();
-    ResetDecoder();
+    if( !parallel )
+        ok = DecodeMCUs( sc, m_strm, mcu1, mcu2 );
+    if( !ok )
+        return false;
+
+    padOutput( sc );
+    return true;
+}
+
+
+// decodes the MCUs [mcu1, mcu2) of the scan. mcu1 must be at the start of a restart interval.
+// For a progressive image the MCUs of the roi are built from the decoded coefficients
+bool  GrFmtJpegReader::DecodeMCUs( const JpegScan& sc, JpegBitReader& strm, int mcu1, int mcu2 ) const
+{
+    short temp[64];
+    short blocks[10][64];
+    int   dc_pred[3] = { 0, 0, 0 };
+    int   i, mcu;
+
+    // GetBlock writes the nonzero coefficients only, the others are kept zero
+    memset( temp, 0, sizeof(temp) );
+    int   left = m_MCUs > 0 ? m_MCUs : INT_MAX; // MCUs left in the restart interval
+    int   mx = mcu1 % sc.mcu_cols, my = mcu1 / sc.mcu_cols;
+    int   x1 = mx*sc.h[0], y1 = my*sc.v[0];
+    bool  stored = sc.coeffs[0] != 0;
+    const Rect& roi = sc.roi;
 
-    for( mcu = 0;; mcu++ )
+    for( mcu = mcu1; mcu < mcu2; mcu++ )
     {
-        int  x2, y2, x, y, xc;
-        int* cmp;
-        uchar* data1;
+        int  x2, y2, x, y;
+        short* cmp;
+        // MCUs outside of the roi are only entropy-decoded
+        bool inside = x1 < sc.rx2 && x1 + sc.h[0] > roi.x && y1 < sc.ry2 && y1 + sc.v[0] > roi.y;
 
-        if( mcu == m_MCUs && m_MCUs != 0 )
+        if( !stored )
         {
-            ResetDecoder();
-            m_strm.AlignOnByte();
-            mcu = 0;
+            if( left == 0 )
+            {
+                dc_pred[0] = dc_pred[1] = dc_pred[2] = 0;
+                strm.Restart();
+                left = m_MCUs;
+            }
+            left--;
         }
 
         // Get mcu
-        for( i = 0; i < ns; i++ )
+        if( inside || !stored )
         {
-            int  c = idx[i];
-            cmp = blocks[pos[c]];
-            for( y = 0; y < v[c]; y += 8, cmp += h[c]*8 )
-                for( x = 0; x < h[c]; x += 8 )
-                {
-                    GetBlock( temp, c );
-                    if( i < (color ? 3 : 1))
+            for( i = 0; i < sc.ns; i++ )
+            {
+                int  c = sc.idx[i];
+                int  h = sc.h[c], bs = sc.bs[c];
+                cmp = blocks[sc.pos[c]];
+                for( y = 0; y < sc.v[c]; y += bs, cmp += h*bs )
+                    for( x = 0; x < h; x += bs )
                     {
-                        aan_idct8x8( temp, cmp + x, h[c] );
+                        const short* src = temp;
+                        int last = 63;
+                        if( stored )
+                            src = sc.coeffs[c] + ((my*m_ci[c].v + y/bs)*sc.coeff_step[c] +
+                                                  mx*m_ci[c].h + x/bs)*64;
+                        else if( (last = GetBlock( strm, temp, c, dc_pred[c] )) < 0 )
+                            return false;
+                        if( inside && (c == 0 || sc.decode_chroma) )
+                        {
+                            // zigzag indices up to 9 are in the 4x4 corner
+                            int k = last == 0 ? 0 : last <= 9 ? 1 : 2;
+                            sc.idct[c][k]( src, m_tq[(int)m_ci[c].tq], cmp + x, h );
+                        }
+                        if( !stored )
+                        {
+                            if( last < 16 )
+                                for( int j = 0; j <= last; j++ )
+                                    temp[zigzag[j]] = 0;
+                            else
+                                memset( temp, 0, sizeof(temp) );
+                        }
                     }
-                }
+            }
+
+            // the data ended within the MCU
+            if( !stored && strm.Overrun() )
+                return false;
+        }
+
+        if( inside )
+        {
+            int sx = std::max( roi.x - x1, 0 ), sy = std::max( roi.y - y1, 0 );
+            x2 = std::min( x1 + sc.h[0], sc.rx2 ) - x1 - sx;
+            y2 = std::min( y1 + sc.v[0], sc.ry2 ) - y1 - sy;
+
+            storeMCU( sc.out, blocks[0], sc.h[0],
+                      sc.decode_chroma ? blocks[sc.pos[1]] : 0,
+                      sc.decode_chroma ? blocks[sc.pos[2]] : 0,
+                      sc.decode_chroma ? sc.h[1] : 0, sc.x_shift, sc.y_shift,
+                      sx, sy, x1 + sx - roi.x, y1 + sy - roi.y, x2, y2 );
+        }
+
+        x1 += sc.h[0];
+        mx++;
+        if( x1 >= sc.width )
+        {
+            x1 = mx = 0;
+            y1 += sc.v[0];
+            my++;
         }
+    }
+    return true;
+}
+
+
+////////////////////// progressive JPEG //////////////////////
+
+// allocates the coefficients of all the blocks of the image, including the padding ones of the MCUs
+void  GrFmtJpegReader::AllocCoefficients()
+{
+    int  mcu_cols = (m_width + m_ci[0].h*8 - 1)/(m_ci[0].h*8);
+    int  mcu_rows = (m_height + m_ci[0].v*8 - 1)/(m_ci[0].v*8);
+    size_t ofs[3], total = 0;
+
+    for( int c = 0; c < m_planes; c++ )
+    {
+        m_coeff_step[c] = mcu_cols*m_ci[c].h;
+        ofs[c] = total;
+        total += (size_t)m_coeff_step[c]*mcu_rows*m_ci[c].v*64;
+    }
+
+    m_coeffs.assign( total, (short)0 );
+    for( int c = 0; c < m_planes; c++ )
+        m_coeff[c] = &m_coeffs[ofs[c]];
+}
+
+
+// decodes a Huffman code; the value bits of the progressive scans are read separately
+static inline int getHuffSymbol( JpegBitReader& strm, const int* fast, const short* table )
+{
+    strm.Refill();
+    int e = fast[strm.Show( fast_table_bits )];
+    if( e == 0 )
+        return strm.GetHuff( table );
+    int sym = (e >> 8) & 255;
+    strm.Move( (e & 31) - (e & 32 ? sym & 15 : 0) );
+    return sym;
+}
+
+
+// decodes a progressive scan, or a sequential one when only the coefficients are read, into the coefficients
+bool  GrFmtJpegReader::ProcessCoefficientScan( const int* idx, int ns )
+{
+    int  mcu_cols = (m_width + m_ci[0].h*8 - 1)/(m_ci[0].h*8);
+    int  mcu_rows = (m_height + m_ci[0].v*8 - 1)/(m_ci[0].v*8);
+    bool progressive = m_type == 2;
+    int  c = idx[0], cols = mcu_cols, count;
+    int  dc_pred[3] = { 0, 0, 0 }, eobrun = 0;
+    int  left = m_MCUs > 0 ? m_MCUs : INT_MAX;
+
+    if( ns == 1 )
+    {
+        // a scan of a single component goes over its blocks, not the MCUs
+        int w = (m_width*m_ci[c].h + m_ci[0].h - 1)/m_ci[0].h;
+        int h = (m_height*m_ci[c].v + m_ci[0].v - 1)/m_ci[0].v;
+        cols = (w + 7)/8;
+        count = cols*((h + 7)/8);
+    }
+    else
+        count = mcu_cols*mcu_rows;
 
-        y2 = v[0];
-        x2 = h[0];
+    m_strm.Init( m_low_strm.GetPtr() );
 
-        if( y1 + y2 > m_height ) y2 = m_height - y1;
-        if( x1 + x2 > m_width ) x2 = m_width - x1;
+    for( int unit = 0; unit < count; unit++ )
+    {
+        int  ux = unit % cols, uy = unit / cols;
 
-        cmp = blocks[0];
-        data1 = data + x1*nch;
+        if( left == 0 )
+        {
+            dc_pred[0] = dc_pred[1] = dc_pred[2] = 0;
+            eobrun = 0;
+            m_strm.Restart();
+            left = m_MCUs;
+        }
+        left--;
 
         if( ns == 1 )
-            for( y = 0; y < y2; y++, data1 += step, cmp += h[0] )
+        {
+            short* block = m_coeff[c] + ((size_t)uy*m_coeff_step[c] + ux)*64;
+            if( progressive ? !GetProgressiveBlock( block, c, dc_pred[c], eobrun ) :
+                GetBlock( m_strm, block, c, dc_pred[c] ) < 0 )
+                return false;
+        }
+        else
+            for( int i = 0; i < ns; i++ )
             {
-                if( color )
-                {
-                    for( x = 0; x < x2; x++ )
-                    {
-                        int val = descale( cmp[x] + 128*4, 2 );
-                        data1[x*3] = data1[x*3 + 1] = data1[x*3 + 2] = saturate( val );
-                    }
-                }
-                else
-                {
-                    for( x = 0; x < x2; x++ )
+                int  k = idx[i];
+                for( int y = 0; y < m_ci[k].v; y++ )
+                    for( int x = 0; x < m_ci[k].h; x++ )
                     {
-                        int val = descale( cmp[x] + 128*4, 2 );
-                        data1[x] = saturate( val );
+                        short* block = m_coeff[k] + ((size_t)(uy*m_ci[k].v + y)*m_coeff_step[k] +
+                                                     ux*m_ci[k].h + x)*64;
+                        if( progressive ? !GetProgressiveBlock( block, k, dc_pred[k], eobrun ) :
+                            GetBlock( m_strm, block, k, dc_pred[k] ) < 0 )
+                            return false;
                     }
-                }
             }
+
+        if( m_strm.Overrun() )
+            return false;
+    }
+
+    m_low_strm.SetPtr( m_strm.GetPtr() );
+    return true;
+}
+
+
+// decodes the part of a block of a progressive scan: the first DC or AC scan
+// or the refinement by a bit (successive approximation), as in Annex G
+bool  GrFmtJpegReader::GetProgressiveBlock( short* block, int c, int& dc_pred, int& eobrun )
+{
+    JpegBitReader& strm = m_strm;
+    int  k, r, s;
+
+    if( m_ss == 0 ) // DC scan
+    {
+        if( m_ah == 0 )
+        {
+            s = getHuffSymbol( strm, m_td_fast[(int)m_ci[c].td], m_td[(int)m_ci[c].td] );
+            if( s > 15 ) return false;
+            int mask = bs_bit_mask[s], val = strm.Get( s );
+            val -= (val*2 <= mask ? mask : 0);
+            dc_pred += val;
+            block[0] = (short)(dc_pred*(1 << m_al));
+        }
         else
         {
-            for( y = 0; y < y2; y++, data1 += step, cmp += h[0] )
+            strm.Refill();
+            if( strm.Get( 1 ))
+                block[0] |= 1 << m_al;
+        }
+        return true;
+    }
+
+    const int*   ta_fast = m_ta_fast[(int)m_ci[c].ta];
+    const short* ta = m_ta[(int)m_ci[c].ta];
+
+    if( m_ah == 0 ) // the first AC scan
+    {
+        if( eobrun > 0 )
+        {
+            eobrun--;
+            return true;
+        }
+        for( k = m_ss; k <= m_se; k++ )
+        {
+            s = getHuffSymbol( strm, ta_fast, ta );
+            if( s == RBS_HUFF_FORB ) return false;
+            r = s >> 4;
+            s &= 15;
+            if( s != 0 )
             {
-                if( color )
-                {
-                    int  shift = h[1]*(y >> y_shift);
-                    int* cmpCb = blocks[pos[1]] + shift;
-                    int* cmpCr = blocks[pos[2]] + shift;
-                    x = 0;
-                    if( x_shift == 0 )
-                    {
-                        for( ; x < x2; x++ )
-                        {
-                            int Y  = (cmp[x] + 128*4) << fixc;
-                            int Cb = cmpCb[x];
-                            int Cr = cmpCr[x];
-                            int t = (Y + Cb*b_cb) >> (fixc + 2);
-                            data1[x*3] = saturate(t);
-                            t = (Y + Cb*g_cb + Cr*g_cr) >> (fixc + 2);
-                            data1[x*3 + 1] = saturate(t);
-                            t = (Y + Cr*r_cr) >> (fixc + 2);
-                            data1[x*3 + 2] = saturate(t);
-                        }
-                    }
-                    else if( x_shift == 1 )
-                    {
-                        for( xc = 0; x <= x2 - 2; x += 2, xc++ )
-                        {
-                            int Y  = (cmp[x] + 128*4) << fixc;
-                            int Cb = cmpCb[xc];
-                            int Cr = cmpCr[xc];
-                            int t = (Y + Cb*b_cb) >> (fixc + 2);
-                            data1[x*3] = saturate(t);
-                            t = (Y + Cb*g_cb + Cr*g_cr) >> (fixc + 2);
-                            data1[x*3 + 1] = saturate(t);
-                            t = (Y + Cr*r_cr) >> (fixc + 2);
-                            data1[x*3 + 2] = saturate(t);
-                            Y = (cmp[x+1] + 128*4) << fixc;
-                            t = (Y + Cb*b_cb) >> (fixc + 2);
-                            data1[x*3 + 3] = saturate(t);
-                            t = (Y + Cb*g_cb + Cr*g_cr) >> (fixc + 2);
-                            data1[x*3 + 4] = saturate(t);
-                            t = (Y + Cr*r_cr) >> (fixc + 2);
-                            data1[x*3 + 5] = saturate(t);
-                        }
-                    }
-                    for( ; x < x2; x++ )
-                    {
-                        int Y  = (cmp[x] + 128*4) << fixc;
-                        int Cb = cmpCb[x >> x_shift];
-                        int Cr = cmpCr[x >> x_shift];
-                        int t = (Y + Cb*b_cb) >> (fixc + 2);
-                        data1[x*3] = saturate(t);
-                        t = (Y + Cb*g_cb + Cr*g_cr) >> (fixc + 2);
-                        data1[x*3 + 1] = saturate(t);
-                        t = (Y + Cr*r_cr) >> (fixc + 2);
-                        data1[x*3 + 2] = saturate(t);
-                    }
-                }
-                else
+                k += r;
+                int mask = bs_bit_mask[s], val = strm.Get( s );
+                val -= (val*2 <= mask ? mask : 0);
+                block[zigzag[k]] = (short)(val*(1 << m_al));
+            }
+            else if( r < 15 )
+            {
+                // end of band run
+                eobrun = (1 << r) - 1;
+                if( r > 0 )
+                    eobrun += strm.Get( r );
+                break;
+            }
+            else
+                k += 15;
+        }
+        return true;
+    }
+
+    // AC refinement: the nonzero coefficients get a bit each, the new ones are +-1
+    int  p1 = 1 << m_al;
+
+    k = m_ss;
+    if( eobrun == 0 )
+    {
+        for( ; k <= m_se; k++ )
+        {
+            s = getHuffSymbol( strm, ta_fast, ta );
+            if( s == RBS_HUFF_FORB ) return false;
+            r = s >> 4;
+            s &= 15;
+            if( s != 0 )
+            {
+                if( s != 1 ) return false;
+                s = strm.Get( 1 ) ? p1 : -p1;
+            }
+            else if( r != 15 )
+            {
+                eobrun = 1 << r;
+                if( r > 0 )
+                    eobrun += strm.Get( r );
+                break;
+            }
+
+            // skip r zero coefficients, refining the nonzero ones on the way
+            do
+            {
+                short* coef = block + zigzag[k];
+                if( *coef != 0 )
                 {
-                    for( x = 0; x < x2; x++ )
-                    {
-                        int val = descale( cmp[x] + 128*4, 2 );
-                        data1[x] = saturate(val);
-                    }
+                    strm.Refill();
+                    if( strm.Get( 1 ) && (*coef & p1) == 0 )
+                        *coef = (short)(*coef + (*coef >= 0 ? p1 : -p1));
                 }
+                else if( --r < 0 )
+                    break;
+                k++;
             }
+            while( k <= m_se );
+
+            if( s != 0 )
+                block[zigzag[k]] = (short)s;
         }
-        
-        x1 += h[0];
-        if( x1 >= m_width )
+    }
+
+    if( eobrun > 0 )
+    {
+        // the rest of the band is refined only
+        for( ; k <= m_se; k++ )
         {
-            x1 = 0;
-            y1 += v[0];
-            data += v[0]*step;
-            if( y1 >= m_height ) break;
+            short* coef = block + zigzag[k];
+            if( *coef != 0 )
+            {
+                strm.Refill();
+                if( strm.Get( 1 ) && (*coef & p1) == 0 )
+                    *coef = (short)(*coef + (*coef >= 0 ? p1 : -p1));
+            }
         }
+        eobrun--;
+    }
+    return true;
+}
+
+
+// builds the output from the coefficients of a progressive image
+bool  GrFmtJpegReader::StoreCoefficients( uchar* data, int step, int colorspace, int scale, Rect roi )
+{
+    JpegScan sc;
+
+    InitScan( sc, data, step, colorspace, scale, roi );
+    for( int c = 0; c < m_planes; c++ )
+    {
+        sc.coeffs[c] = m_coeff[c];
+        sc.coeff_step[c] = m_coeff_step[c];
     }
+
+    if( !DecodeMCUs( sc, m_strm, (sc.roi.y/sc.v[0])*sc.mcu_cols, sc.mcu_end ))
+        return false;
+    padOutput( sc );
+    return true;
 }
 
 
-void  GrFmtJpegReader::GetBlock( int* block, int c )
+void  GrFmtJpegReader::GetCoefficients( JpegCoefficients& coeffs ) const
+{
+    coeffs.width = m_width;
+    coeffs.height = m_height;
+    coeffs.ncomponents = m_planes;
+    for( int c = 0; c < 3; c++ )
+    {
+        bool valid = c < m_planes;
+        coeffs.h[c] = valid ? m_ci[c].h : 0;
+        coeffs.v[c] = valid ? m_ci[c].v : 0;
+        coeffs.blocks[c] = valid ? m_coeff[c] : 0;
+        coeffs.blocks_per_row[c] = valid ? m_coeff_step[c] : 0;
+        memcpy( coeffs.qtab[c], m_tq[valid ? m_ci[c].tq : 0].q, sizeof(coeffs.qtab[c]) );
+    }
+}
+
+
+// gets the quantized coefficients of a block; they are dequantized by the IDCT.
+// The block must be zero, only the decoded coefficients are written. Returns the zigzag
+// index of the last one (the coefficients after it are zero) or -1 on an invalid code
+int  GrFmtJpegReader::GetBlock( JpegBitReader& strm, short* block, int c, int& dc_pred ) const
 {
-    memset( block, 0, 64*sizeof(block[0]) );
-    
     assert( 0 <= c && c < 3 );
-    const short* td = m_td[m_ci[c].td];
-    const short* ta = m_ta[m_ci[c].ta];
-    const int* tq = m_tq[m_ci[c].tq];
+    const short* td = m_td[(int)m_ci[c].td];
+    const short* ta = m_ta[(int)m_ci[c].ta];
+    const int* td_fast = m_td_fast[(int)m_ci[c].td];
+    const int* ta_fast = m_ta_fast[(int)m_ci[c].ta];
+    int i = 0, cat, mask, val;
     
     // Get DC coefficient
-    int i = 0, cat  = m_strm.GetHuff( td );
-    int mask = bs_bit_mask[cat];
-    int val  = m_strm.Get( cat );
-    
-    val -= (val*2 <= mask ? mask : 0);
-    m_ci[c].dc_pred = val += m_ci[c].dc_pred;
+    strm.Refill();
+    int e = td_fast[strm.Show( fast_table_bits )];
+    if( e & 32 )
+    {
+        strm.Move( e & 31 );
+        val = e >> 16;
+    }
+    else
+    {
+        if( e != 0 )
+        {
+            strm.Move( e & 31 );
+            cat = (e >> 8) & 255;
+        }
+        else
+            cat = strm.GetHuff( td );
+        if( cat > 15 ) return -1;
+        mask = bs_bit_mask[cat];
+        val  = strm.Get( cat );
+        val -= (val*2 <= mask ? mask : 0);
+    }
+    dc_pred = val += dc_pred;
     
-    block[0] = descale(val * tq[0],16);
+    block[0] = (short)val;
     
     // Get AC coeffs
     for(;;)
     {
-        cat = m_strm.GetHuff( ta );
+        // common case: the code and the value are taken by a single lookup
+        strm.Refill();
+        e = ta_fast[strm.Show( fast_table_bits )];
+        if( e & 32 )
+        {
+            strm.Move( e & 31 );
+            i += (e >> 12) & 15;
+            block[zigzag[++i]] = (short)(e >> 16);
+            if( i >= 63 ) break;
+            continue;
+        }
+        if( e != 0 )
+        {
+            strm.Move( e & 31 );
+            cat = (e >> 8) & 255;
+        }
+        else
+            cat = strm.GetHuff( ta );
         if( cat == 0 ) break; // end of block
+        if( cat == RBS_HUFF_FORB ) return -1;
         
         i += (cat >> 4) + 1;
         cat &= 15;
         mask = bs_bit_mask[cat];
-        val  = m_strm.Get( cat );
+        val  = strm.Get( cat );
         cat  = zigzag[i];
         val -= (val*2 <= mask ? mask : 0);
-        block[cat] = descale(val * tq[cat], 16);
-        assert( i <= 63 );
-        if( i >= 63 ) break;
+        block[cat] = (short)val;
+        if( i >= 63 ) break; // a run past the end lands on the padding of zigzag
     }
+    return std::min( i, 63 );
 }
 
 
@@ -2780,17 +3662,105 @@ void writeJpeg(const std::string& filename, const Mat& img)
     writer.WriteImage(img.data, (int)img.step, img.cols, img.rows, 0, img.channels());
 }
 
-Mat readJpeg(const std::string& filename)
+// allocates the output image of the given size and format
+static void createOutput( Mat& img, int width, int height, int colorspace )
+{
+    switch( colorspace )
+    {
+    case COLORSPACE_GRAY:
+        img.create( height, width, CV_8UC1 );
+        break;
+    case COLORSPACE_BGR:
+        img.create( height, width, CV_8UC3 );
+        break;
+    case COLORSPACE_BGRA:
+        img.create( height, width, CV_8UC4 );
+        break;
+    case COLORSPACE_YUV444P:
+        img.create( height*3, width, CV_8UC1 );
+        break;
+    case COLORSPACE_NV12:
+    case COLORSPACE_I420:
+        width = (width + 1) & -2;
+        height = (height + 1) & -2;
+        img.create( height*3/2, width, CV_8UC1 );
+        break;
+    default:
+        CV_Error( CV_StsBadArg, "unsupported output colorspace" );
+    }
+}
+
+// decodes the image whose header is read by the reader
+static bool decodeImage( GrFmtJpegReader& reader, Mat& img, int colorspace, int scale, Rect roi )
+{
+    CV_Assert( scale == 1 || scale == 2 || scale == 4 || scale == 8 );
+
+    // the roi of the downscaled image, covering all the pixels of the requested one
+    Rect r( 0, 0, reader.m_width, reader.m_height );
+    if( roi.area() > 0 )
+        r &= roi;
+    if( r.area() == 0 )
+        CV_Error( CV_StsBadArg, "roi is outside of the image" );
+    int x1 = r.x/scale, y1 = r.y/scale;
+    int x2 = (r.x + r.width + scale - 1)/scale, y2 = (r.y + r.height + scale - 1)/scale;
+    // 4:2:0 planes start at even positions
+    if( colorspace == COLORSPACE_NV12 || colorspace == COLORSPACE_I420 )
+        x1 &= -2, y1 &= -2;
+
+    createOutput(img, x2 - x1, y2 - y1, colorspace);
+    return reader.ReadData(img.data, (int)img.step, colorspace, scale, Rect(x1, y1, x2 - x1, y2 - y1));
+}
+
+Mat readJpeg(const std::string& filename, int colorspace, int scale, Rect roi)
 {
+    CV_Assert( scale == 1 || scale == 2 || scale == 4 || scale == 8 );
     GrFmtJpegReader reader(filename.c_str());
     bool ok = reader.ReadHeader();
     if(!ok)
         return Mat();
-    Mat img(reader.m_height, reader.m_width, CV_8UC3);
-    reader.ReadData(img.data, (int)img.step, true);
+
+    Mat img;
+    decodeImage(reader, img, colorspace, scale, roi);
     return img;
 }
 
+class JpegDecoderImpl : public JpegDecoder
+{
+public:
+    bool decode(const uchar* data, size_t len, Mat& dst, int colorspace, int scale, Rect roi)
+    {
+        CV_Assert( scale == 1 || scale == 2 || scale == 4 || scale == 8 );
+        return reader.ReadHeader(data, len) && decodeImage(reader, dst, colorspace, scale, roi);
+    }
+
+    void setParallel(bool parallel)
+    {
+        reader.SetParallel(parallel);
+    }
+
+    bool decodeCoefficients(const uchar* data, size_t len, JpegCoefficients& coeffs)
+    {
+        if( !reader.ReadHeader(data, len) || !reader.ReadData(0, 0, COLORSPACE_GRAY) )
+            return false;
+        reader.GetCoefficients(coeffs);
+        return true;
+    }
+
+protected:
+    GrFmtJpegReader reader;
+};
+
+Ptr<JpegDecoder> createJpegDecoder()
+{
+    return Ptr<JpegDecoder>(new JpegDecoderImpl);
+}
+
+bool decodeJpeg(const uchar* data, size_t len, Mat& dst, int colorspace, int scale, Rect roi)
+{
+    JpegDecoderImpl decoder;
+    return decoder.decode(data, len, dst, colorspace, scale, roi);
+}
+
 }
 }
 
@@ -0,0 +1,61 @@
+// decoding of a JPEG image with a malformed Huffman table (more codes of a length than the length
+// allows) fails instead of writing past the lookup tables
+#include "../mjpegwriter.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace cv;
+
+int main()
+{
+    const char* filename = "test_bad_huffman_table.jpg";
+    Mat img(64, 64, CV_8UC1), dst;
+    for( int y = 0; y < img.rows; y++ )
+        for( int x = 0; x < img.cols; x++ )
+            img.ptr(y)[x] = (uchar)(x*4 ^ y*3);
+    jpeg::writeJpeg(filename, img);
+
+    std::vector<uchar> data;
+    FILE* f = fopen(filename, "rb");
+    if( f )
+    {
+        uchar buf[4096];
+        size_t n;
+        while( (n = fread(buf, 1, sizeof(buf), f)) > 0 )
+            data.insert(data.end(), buf, buf + n);
+        fclose(f);
+    }
+    remove(filename);
+
+    bool ok = jpeg::decodeJpeg(&data[0], data.size(), dst, jpeg::COLORSPACE_GRAY) &&
+              dst.cols == img.cols && dst.rows == img.rows;
+    if( !ok )
+        printf( "FAILED: decoding of the image\n" );
+
+    // the codes of the first table in DHT are moved to length 2, of 3 codes at most
+    size_t i;
+    for( i = 2; i + 21 < data.size() && !(data[i] == 0xFF && data[i + 1] == 0xC4); i++ )
+        ;
+    if( i + 21 >= data.size() )
+    {
+        printf( "FAILED: no DHT in the image\n" );
+        return 1;
+    }
+    uchar* counts = &data[i + 5];
+    int ncodes = 0;
+    for( int k = 0; k < 16; k++ )
+    {
+        ncodes += counts[k];
+        counts[k] = 0;
+    }
+    counts[1] = (uchar)ncodes;
+
+    if( jpeg::decodeJpeg(&data[0], data.size(), dst, jpeg::COLORSPACE_GRAY) )
+    {
+        printf( "FAILED: the image with %d codes of length 2 is decoded\n", ncodes );
+        ok = false;
+    }
+    printf( "%s\n", ok ? "passed" : "failed" );
+    return ok ? 0 : 1;
+}
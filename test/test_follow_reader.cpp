@@ -0,0 +1,75 @@
+// follow mode of MJpegReader: the frames of a file are read while MJpegWriter is still writing it
+// (the RIFF and 'movi' sizes are not patched yet), then the rest of them once the writer closes it
+#include "../mjpegreader.hpp"
+#include "../mjpegwriter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace cv;
+using namespace cv::mjpeg;
+
+static int nfailed = 0;
+
+static void check( bool ok, const char* what )
+{
+    if( !ok )
+    {
+        printf( "FAILED: %s\n", what );
+        nfailed++;
+    }
+}
+
+// grabs the frames that are in the file and checks that they decode to the frame size
+static int grabFrames( MJpegReader& reader, Size size, int timeout_ms )
+{
+    const uchar* data;
+    size_t len;
+    Mat img;
+    int count = 0;
+
+    while( reader.grab(data, len, timeout_ms) )
+    {
+        check( jpeg::decodeJpeg(data, len, img) && img.cols == size.width && img.rows == size.height,
+               "decoding of a grabbed frame" );
+        count++;
+    }
+    return count;
+}
+
+int main()
+{
+    const char* filename = "test_follow_reader.avi";
+    const int nframes = 20;
+    Size size(320, 240);
+    Mat frame(size, CV_8UC3);
+
+    // the frames are noise, so most of them are flushed to the file before it is closed
+    Ptr<MJpegWriter> writer = openMJpegWriter(filename, size, 30, MJpegWriter::COLORSPACE_BGR);
+    check( !writer.empty() && writer->isOpened(), "opening of the writer" );
+    if( nfailed )
+        return 1;
+    srand(1);
+    for( int i = 0; i < nframes; i++ )
+    {
+        for( int y = 0; y < size.height; y++ )
+            for( int x = 0; x < size.width*3; x++ )
+                frame.ptr(y)[x] = (uchar)(rand() & 255);
+        check( writer->write(frame), "writing of a frame" );
+    }
+
+    Ptr<MJpegReader> reader = openMJpegReader(filename, Size(), 0, MJpegReader::COLORSPACE_BGR, true);
+    check( !reader.empty(), "opening of the file being written" );
+    if( nfailed )
+        return 1;
+
+    int count = grabFrames( *reader, size, 0 );
+    check( count > 0, "frames of the file being written" );
+
+    writer.release();
+    count += grabFrames( *reader, size, 1000 );
+    check( count == nframes, "frames of the closed file" );
+
+    printf( "%d frames grabbed, %d checks failed\n", count, nfailed );
+    remove( filename );
+    return nfailed ? 1 : 0;
+}
@@ -0,0 +1,135 @@
+// accuracy of the SSE2 IDCT of the decoder against the scalar one on random quantized blocks,
+// for the quantization tables of both 8-bit and 16-bit DQT segments as the decoder loads them:
+// the 8-bit samples they give must differ by 1 at most
+#include "../refjpeg.cpp"
+#include <math.h>
+
+#ifdef WITH_SSE2
+
+using namespace cv::jpeg;
+
+static int randInt( int a, int b )
+{
+    return a + (int)(((unsigned)rand()*32768u + (unsigned)rand()) % (unsigned)(b - a + 1));
+}
+
+// the table as LoadQuantTables makes it of the factors of a DQT segment (in the order of the blocks)
+static void initQuantTable( QuantTable& qt, const int* q, bool q16 )
+{
+    for( int i = 0; i < 64; i++ )
+    {
+        qt.tq[i] = q[i] * (q16 ? 1 : 16) * idct_prescale[i];
+        qt.q[i] = (ushort)q[i];
+        int hi = (qt.tq[i] + 32768) >> 16;
+        qt.tq_hi[i] = (short)hi;
+        qt.tq_lo[i] = (short)(qt.tq[i] - hi*65536);
+    }
+}
+
+// quantized DCT of a random block of 8-bit samples: a gradient with noise, or noise only.
+// The coefficients of the rows and the columns from size on are zero
+static void randomBlock( const QuantTable& qt, short* coef, int size )
+{
+    double px[8][8];
+    int a = randInt(0, 255), gx = randInt(-32, 32), gy = randInt(-32, 32), noise = randInt(0, 255);
+    if( randInt(0, 3) == 0 )
+        a = 128, gx = gy = 0;
+    for( int y = 0; y < 8; y++ )
+        for( int x = 0; x < 8; x++ )
+        {
+            int v = a + gx*(2*x - 7)/8 + gy*(2*y - 7)/8 + randInt(0, noise) - noise/2;
+            px[y][x] = std::min(std::max(v, 0), 255) - 128;
+        }
+
+    // the DCT of the rows, then of the columns; c[u][x] are the basis functions
+    double c[8][8], rows[8][8];
+    for( int u = 0; u < 8; u++ )
+        for( int x = 0; x < 8; x++ )
+            c[u][x] = cos((2*x + 1)*u*CV_PI/16)*(u ? 0.5 : 0.35355339);
+    for( int y = 0; y < 8; y++ )
+        for( int u = 0; u < 8; u++ )
+        {
+            double s = 0;
+            for( int x = 0; x < 8; x++ )
+                s += px[y][x]*c[u][x];
+            rows[y][u] = s;
+        }
+
+    for( int u = 0; u < 8; u++ )
+        for( int v = 0; v < 8; v++ )
+        {
+            int idx = u*8 + v;
+            double s = 0;
+            for( int y = 0; y < 8; y++ )
+                s += rows[y][u]*c[v][y];
+            // the quantization step in the units of the coefficients
+            double step = (double)qt.tq[idx]/(16*idct_prescale[idx]);
+            coef[idx] = u < size && v < size ? (short)floor(s/step + 0.5) : 0;
+        }
+}
+
+// the maximal differences of the outputs and of the samples they give
+static void testTables( bool q16, int ntables, int nblocks, int& maxdiff, int& maxdiff8u )
+{
+    QuantTable qt;
+    short coef[64], d0[64], d1[64];
+    int q[64];
+
+    maxdiff = maxdiff8u = 0;
+
+    for( int t = 0; t < ntables; t++ )
+    {
+        // uniform tables of small and large steps and the ones growing with the frequency
+        int kind = t % 3, q0 = q16 ? randInt(1, 4096) : randInt(1, 255);
+        for( int i = 0; i < 64; i++ )
+        {
+            int f = (i >> 3) + (i & 7);
+            q[i] = kind == 0 ? q0 : kind == 1 ? q0 + randInt(0, q0/4) : q0*(8 + f)/8;
+            q[i] = std::min(std::max(q[i], 1), q16 ? 65535 : 255);
+        }
+        initQuantTable( qt, q, q16 );
+
+        for( int b = 0; b < nblocks; b++ )
+        {
+            bool low = b % 2 != 0;
+            randomBlock( qt, coef, low ? 4 : 8 );
+            if( low )
+            {
+                aan_idct8x8_low( coef, qt, d0, 8 );
+                aan_idct8x8_low_sse2( coef, qt, d1, 8 );
+            }
+            else
+            {
+                aan_idct8x8( coef, qt, d0, 8 );
+                aan_idct8x8_sse2( coef, qt, d1, 8 );
+            }
+            for( int i = 0; i < 64; i++ )
+            {
+                int s0 = saturate(descale(d0[i] + 128*4, 2)), s1 = saturate(descale(d1[i] + 128*4, 2));
+                maxdiff = std::max(maxdiff, abs(d0[i] - d1[i]));
+                maxdiff8u = std::max(maxdiff8u, abs(s0 - s1));
+            }
+        }
+    }
+}
+
+int main()
+{
+    srand(1);
+    int diff8, diff8_8u, diff16, diff16_8u;
+    testTables( false, 300, 200, diff8, diff8_8u );
+    testTables( true, 300, 200, diff16, diff16_8u );
+    printf( "max difference of the samples (of the outputs): %d (%d) of 8-bit tables, %d (%d) of 16-bit tables\n",
+            diff8_8u, diff8, diff16_8u, diff16 );
+    return diff8_8u <= 1 && diff16_8u <= 1 ? 0 : 1;
+}
+
+#else
+
+int main()
+{
+    printf( "SSE2 is not available\n" );
+    return 0;
+}
+
+#endif